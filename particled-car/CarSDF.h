@@ -0,0 +1,268 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Signed distance field of the car, for particle collisions.
+// Baked once from the triangle meshes (negative inside) on a grid of
+// cellSize, stored sparsely : the grid is cut into bricks of BrickCells^3
+// cells, and only the bricks near the surface keep their samples. Every other
+// brick keeps a single value, a bound of the distance anywhere inside it,
+// which is all sphere tracing needs to skip it. A lookup costs the same
+// however many triangles the car has.
+class CarSDF {
+public:
+	static const int BrickCells = 4;
+	static const int BrickSamples = BrickCells + 1;
+
+	CarSDF() : cellSize(0.0f), brickSize(0.0f) {
+		bricks[0] = bricks[1] = bricks[2] = 0;
+	}
+
+	// Add a closed mesh. Its triangles may be wound either way, the inside is
+	// found by ray parity. Meshes may overlap, the field is their union.
+	void AddMesh(const float* vertices, int vertexCount, const unsigned int* elements, int elementCount) {
+		Mesh mesh;
+		mesh.first = (int)triangles.size();
+		for (int i = 0; i + 2 < elementCount; i += 3) {
+			Triangle tri;
+			for (int k = 0; k < 3; k++) {
+				unsigned int v = std::min(elements[i + k], (unsigned int)vertexCount - 1);
+				tri.v[k] = glm::vec3(vertices[3 * v + 0], vertices[3 * v + 1], vertices[3 * v + 2]);
+			}
+			triangles.push_back(tri);
+		}
+		mesh.last = (int)triangles.size();
+		meshes.push_back(mesh);
+	}
+
+	// Bake the field on a grid of cell size around the meshes. Bricks with
+	// surface closer than band to them keep their samples.
+	void Bake(float cell, float band) {
+		cellSize = cell;
+		brickSize = cell * BrickCells;
+		glm::vec3 lo(1e30f), hi(-1e30f);
+		for (size_t t = 0; t < triangles.size(); t++) {
+			for (int k = 0; k < 3; k++) {
+				lo = glm::min(lo, triangles[t].v[k]);
+				hi = glm::max(hi, triangles[t].v[k]);
+			}
+		}
+		// One brick of margin so lookups near the surface never leave the grid
+		origin = lo - glm::vec3(brickSize);
+		glm::vec3 extent = hi - lo + glm::vec3(2.0f * brickSize);
+		for (int axis = 0; axis < 3; axis++) {
+			bricks[axis] = std::max(1, (int)ceilf(extent[axis] / brickSize));
+		}
+		boundsMax = origin + glm::vec3(bricks[0], bricks[1], bricks[2]) * brickSize;
+
+		float halfDiagonal = 0.5f * brickSize * sqrtf(3.0f);
+		int brickCount = bricks[0] * bricks[1] * bricks[2];
+		brickSlot.assign(brickCount, -1);
+		brickBound.assign(brickCount, 0.0f);
+		samples.clear();
+		for (int bz = 0; bz < bricks[2]; bz++) {
+			for (int by = 0; by < bricks[1]; by++) {
+				for (int bx = 0; bx < bricks[0]; bx++) {
+					int brick = (bz * bricks[1] + by) * bricks[0] + bx;
+					glm::vec3 corner = origin + glm::vec3(bx, by, bz) * brickSize;
+					float center = Exact(corner + glm::vec3(0.5f * brickSize));
+					if (fabsf(center) > halfDiagonal + band) {
+						// Far from the surface : keep a bound, |distance| >= it everywhere in the brick
+						brickBound[brick] = center > 0.0f ? center - halfDiagonal : center + halfDiagonal;
+						continue;
+					}
+					brickSlot[brick] = (int)(samples.size() / (BrickSamples * BrickSamples * BrickSamples));
+					for (int z = 0; z < BrickSamples; z++) {
+						for (int y = 0; y < BrickSamples; y++) {
+							for (int x = 0; x < BrickSamples; x++) {
+								samples.push_back(Exact(corner + glm::vec3(x, y, z) * cellSize));
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Number of bricks that keep their samples, out of all bricks
+	int DenseBricks() const {
+		return (int)(samples.size() / (BrickSamples * BrickSamples * BrickSamples));
+	}
+
+	int TotalBricks() const {
+		return (int)brickSlot.size();
+	}
+
+	// Trilinear lookup of the signed distance. Far from the surface, and
+	// outside the grid, this is a lower bound of the distance instead.
+	float Distance(const glm::vec3& p) const {
+		glm::vec3 clamped = glm::clamp(p, origin, boundsMax);
+		float outside = glm::length(p - clamped);
+		glm::vec3 local = (clamped - origin) / brickSize;
+		int bx = std::min((int)local.x, bricks[0] - 1);
+		int by = std::min((int)local.y, bricks[1] - 1);
+		int bz = std::min((int)local.z, bricks[2] - 1);
+		int brick = (bz * bricks[1] + by) * bricks[0] + bx;
+		float inside;
+		int slot = brickSlot[brick];
+		if (slot < 0) {
+			inside = brickBound[brick];
+		}
+		else {
+			glm::vec3 cell = (local - glm::vec3(bx, by, bz)) * (float)BrickCells;
+			int cx = std::min((int)cell.x, BrickCells - 1);
+			int cy = std::min((int)cell.y, BrickCells - 1);
+			int cz = std::min((int)cell.z, BrickCells - 1);
+			float fx = cell.x - cx, fy = cell.y - cy, fz = cell.z - cz;
+			const float* s = &samples[slot * BrickSamples * BrickSamples * BrickSamples + (cz * BrickSamples + cy) * BrickSamples + cx];
+			const int dy = BrickSamples, dz = BrickSamples * BrickSamples;
+			float x00 = s[0] + (s[1] - s[0]) * fx;
+			float x10 = s[dy] + (s[dy + 1] - s[dy]) * fx;
+			float x01 = s[dz] + (s[dz + 1] - s[dz]) * fx;
+			float x11 = s[dz + dy] + (s[dz + dy + 1] - s[dz + dy]) * fx;
+			float y0 = x00 + (x10 - x00) * fy;
+			float y1 = x01 + (x11 - x01) * fy;
+			inside = y0 + (y1 - y0) * fz;
+		}
+		// The meshes are inside the grid, so they are at least outside away
+		return outside > 0.0f ? std::max(outside, inside - outside) : inside;
+	}
+
+	// Outward surface normal near p, from the gradient of the field
+	glm::vec3 Normal(const glm::vec3& p) const {
+		float e = 0.5f * cellSize;
+		glm::vec3 gradient(
+			Distance(p + glm::vec3(e, 0.0f, 0.0f)) - Distance(p - glm::vec3(e, 0.0f, 0.0f)),
+			Distance(p + glm::vec3(0.0f, e, 0.0f)) - Distance(p - glm::vec3(0.0f, e, 0.0f)),
+			Distance(p + glm::vec3(0.0f, 0.0f, e)) - Distance(p - glm::vec3(0.0f, 0.0f, e)));
+		float length = glm::length(gradient);
+		return length > 1e-8f ? gradient / length : glm::vec3(0.0f, 1.0f, 0.0f);
+	}
+
+	// Sphere trace a particle of radius from "from" to "to". On a hit, going
+	// into the surface, returns true with the fraction of the move done before
+	// the contact and the surface normal there. The whole move is swept, so
+	// fast particles and long steps cannot tunnel through thin parts.
+	bool Sweep(const glm::vec3& from, const glm::vec3& to, float radius, float& fraction, glm::vec3& normal) const {
+		glm::vec3 move = to - from;
+		float length = glm::length(move);
+		glm::vec3 direction = length > 1e-8f ? move / length : glm::vec3(0.0f);
+		float minStep = 0.25f * cellSize;
+		float t = 0.0f;
+		for (int iteration = 0; iteration < 64; iteration++) {
+			glm::vec3 p = from + direction * t;
+			float d = Distance(p);
+			float step = d - radius;
+			if (step < 0.0f) {
+				glm::vec3 n = Normal(p);
+				if (glm::dot(direction, n) < 0.0f) {
+					fraction = length > 0.0f ? t / length : 0.0f;
+					normal = n;
+					return true;
+				}
+				// Leaving the surface, like smoke from the exhaust
+				step = 0.0f;
+			}
+			if (t >= length) {
+				return false;
+			}
+			t = std::min(t + std::max(step, minStep), length);
+		}
+		return false;
+	}
+
+private:
+	struct Triangle {
+		glm::vec3 v[3];
+	};
+	struct Mesh {
+		int first, last;
+	};
+
+	std::vector<Triangle> triangles;
+	std::vector<Mesh> meshes;
+	float cellSize;
+	float brickSize;
+	int bricks[3];
+	glm::vec3 origin;
+	glm::vec3 boundsMax;
+	// Per brick : index of its samples, or -1 and brickBound
+	std::vector<int> brickSlot;
+	std::vector<float> brickBound;
+	std::vector<float> samples;
+
+	// Exact signed distance to the meshes, for baking
+	float Exact(const glm::vec3& p) const {
+		float nearest = 1e30f;
+		for (size_t t = 0; t < triangles.size(); t++) {
+			nearest = std::min(nearest, glm::length(p - ClosestPoint(p, triangles[t])));
+		}
+		// Odd number of crossings along a ray : inside that mesh. The direction
+		// is skewed so the ray does not run along the edges of the grid aligned
+		// car faces.
+		const glm::vec3 ray = glm::normalize(glm::vec3(0.5377f, 0.6154f, 0.5763f));
+		for (size_t m = 0; m < meshes.size(); m++) {
+			int crossings = 0;
+			for (int t = meshes[m].first; t < meshes[m].last; t++) {
+				if (RayHits(p, ray, triangles[t])) {
+					crossings++;
+				}
+			}
+			if (crossings & 1) {
+				return -nearest;
+			}
+		}
+		return nearest;
+	}
+
+	// Closest point of a triangle (Ericson, Real-Time Collision Detection 5.1.5)
+	static glm::vec3 ClosestPoint(const glm::vec3& p, const Triangle& tri) {
+		const glm::vec3& a = tri.v[0];
+		const glm::vec3& b = tri.v[1];
+		const glm::vec3& c = tri.v[2];
+		glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+		float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f) return a;
+		glm::vec3 bp = p - b;
+		float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3) return b;
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+		glm::vec3 cp = p - c;
+		float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6) return c;
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+		float denom = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denom) + ac * (vc * denom);
+	}
+
+	// Moller-Trumbore ray / triangle test, hits in front of origin only
+	static bool RayHits(const glm::vec3& origin, const glm::vec3& direction, const Triangle& tri) {
+		glm::vec3 e1 = tri.v[1] - tri.v[0];
+		glm::vec3 e2 = tri.v[2] - tri.v[0];
+		glm::vec3 h = glm::cross(direction, e2);
+		float det = glm::dot(e1, h);
+		if (fabsf(det) < 1e-12f) {
+			return false;
+		}
+		float inv = 1.0f / det;
+		glm::vec3 s = origin - tri.v[0];
+		float u = glm::dot(s, h) * inv;
+		if (u < 0.0f || u > 1.0f) {
+			return false;
+		}
+		glm::vec3 q = glm::cross(s, e1);
+		float v = glm::dot(direction, q) * inv;
+		if (v < 0.0f || u + v > 1.0f) {
+			return false;
+		}
+		return glm::dot(e2, q) * inv > 0.0f;
+	}
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GpuParticles.h"
+#include "ParticleInstance.h"
+
+// GPU depth sort of the CPU particle instances (--gpu-sort, OpenGL 4.3).
+// The instances are uploaded in pool order, and ParticleSortComputeShader
+// sorts (key, index) pairs back to front in a shader storage buffer:
+// the keys are the flipped bits of the squared camera distances, and a
+// bitonic sort orders them with the index breaking ties, so the result is
+// the same as std::sort on the pairs. GpuSortedParticleVertexShader then
+// pulls the instances through the sorted indices. Nothing is read back.
+// The pairs are padded to a power of two, at least one block. Blocks of
+// BlockSize pairs are sorted and merged in shared memory; only the steps
+// comparing pairs further apart than a block go through global memory.
+class GpuParticleSorter {
+public:
+	static const int BlockSize = 512;
+
+	GLuint program;
+	// (key, index) pairs, sorted by the last Sort()
+	GLuint pairBuffer;
+	// Pairs the buffer holds, a power of two
+	int capacity;
+
+	GpuParticleSorter() : program(0), pairBuffer(0), capacity(0) {
+	}
+
+	void Init() {
+		program = LoadComputeShader("ParticleSortComputeShader.computeshader");
+		stageLocation = glGetUniformLocation(program, "Stage");
+		countLocation = glGetUniformLocation(program, "Count");
+		cameraLocation = glGetUniformLocation(program, "Camera");
+		kLocation = glGetUniformLocation(program, "K");
+		jLocation = glGetUniformLocation(program, "J");
+		glGenBuffers(1, &pairBuffer);
+	}
+
+	// Sort the count ParticleInstance records at offset in buffer back to
+	// front from camera. offset must be a multiple of 256 (StreamBuffer regions
+	// are). Leaves the records and the pairs bound for the draw.
+	void Sort(GLuint buffer, GLintptr offset, int count, const glm::vec3& camera) {
+		if (count <= 0) {
+			return;
+		}
+		int n = BlockSize;
+		while (n < count) {
+			n *= 2;
+		}
+		if (n > capacity) {
+			capacity = n;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, pairBuffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)capacity * 2 * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		}
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, GpuSortInstanceBinding, buffer, offset, (GLsizeiptr)count * sizeof(ParticleInstance));
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, GpuSortPairBinding, pairBuffer, 0, (GLsizeiptr)n * 2 * sizeof(GLuint));
+		glUseProgram(program);
+		glUniform1ui(countLocation, (GLuint)count);
+		glUniform3f(cameraLocation, camera.x, camera.y, camera.z);
+		GLuint blocks = (GLuint)(n / BlockSize);
+		// Keys, and every block sorted
+		glUniform1i(stageLocation, 0);
+		glDispatchCompute(blocks, 1, 1);
+		for (int k = 2 * BlockSize; k <= n; k *= 2) {
+			glUniform1ui(kLocation, (GLuint)k);
+			glUniform1i(stageLocation, 1);
+			for (int j = k / 2; j >= BlockSize; j /= 2) {
+				glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+				glUniform1ui(jLocation, (GLuint)j);
+				glDispatchCompute(blocks, 1, 1);
+			}
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			glUniform1i(stageLocation, 2);
+			glDispatchCompute(blocks, 1, 1);
+		}
+		// The vertex shader reads the pairs next
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+
+	void Delete() {
+		glDeleteProgram(program);
+		glDeleteBuffers(1, &pairBuffer);
+	}
+
+private:
+	GLint stageLocation, countLocation, cameraLocation, kLocation, jLocation;
+};
+
+// Sort random instances on the GPU and compare the order with std::sort of
+// the same distances on the CPU. Positions are multiples of 1/64, exact as
+// half floats; ties are frequent, so only the distances are compared, a
+// position at a time.
+inline bool ValidateGpuParticleSort(GpuParticleSorter& sorter) {
+	const int n = 70001;
+	glm::vec3 camera(0.5f, 1.0f, 4.0f);
+	std::vector<ParticleInstance> instances(n);
+	std::vector<float> distances(n);
+	std::vector<int> order(n);
+	for (int i = 0; i < n; i++) {
+		glm::vec3 p((rand() % 1024 - 512) / 64.0f, (rand() % 1024 - 512) / 64.0f, (rand() % 1024 - 512) / 64.0f);
+		instances[i].xyzs[0] = FloatToHalf(p.x);
+		instances[i].xyzs[1] = FloatToHalf(p.y);
+		instances[i].xyzs[2] = FloatToHalf(p.z);
+		instances[i].xyzs[3] = PackSizeMaterial(0.1f, 0);
+		memset(instances[i].color, 255, 4);
+		glm::vec3 d = p - camera;
+		distances[i] = d.x * d.x + d.y * d.y + d.z * d.z;
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return distances[a] > distances[b] || (distances[a] == distances[b] && a < b); });
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, n * sizeof(ParticleInstance), &instances[0], GL_STATIC_DRAW);
+	sorter.Sort(buffer, 0, n, camera);
+	std::vector<GLuint> pairs(2 * n);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sorter.pairBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n * 2 * sizeof(GLuint), &pairs[0]);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glDeleteBuffers(1, &buffer);
+	// Every instance once, at the distance std::sort has there
+	std::vector<bool> seen(n, false);
+	float error = 0.0f;
+	for (int i = 0; i < n; i++) {
+		GLuint index = pairs[2 * i + 1];
+		if (index >= (GLuint)n || seen[index]) {
+			fprintf(stderr, "GPU particle sort lost instances (position %d)\n", i);
+			return false;
+		}
+		seen[index] = true;
+		error = fmaxf(error, fabsf(distances[index] - distances[order[i]]) / fmaxf(distances[order[i]], 1e-6f));
+	}
+	// The shader may round the distance differently, never more than an ulp or two
+	if (error > 1e-5f) {
+		fprintf(stderr, "GPU particle sort does not match std::sort (max relative error %g)\n", error);
+		return false;
+	}
+	printf("GPU particle sort matches std::sort (%d instances, max relative error %g)\n", n, error);
+	return true;
+}
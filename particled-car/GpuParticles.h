@@ -0,0 +1,301 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+
+// GPU particle path (OpenGL 4.3).
+// Particle state lives in shader storage buffers and never goes through the
+// CPU : ParticleEmitComputeShader pops free slots and spawns particles,
+// ParticleSimulateComputeShader ages, moves and kills them, spawns splashes
+// from rain drops hitting the roof and builds the list of particles to draw.
+// Drawing reads the particle buffer directly through that list with
+// glDrawArraysIndirect, the instance count being written by the simulation.
+
+// Layout of one particle in the SSBO (std430)
+struct GpuParticle {
+	glm::vec4 posLife;
+	glm::vec4 speedSize;
+	glm::vec4 color;
+};
+
+// Spawn parameters of an emitter
+struct GpuParticleEmitter {
+	glm::vec3 origin;
+	glm::vec3 maindir;
+	float spread;
+	float life;
+	glm::vec4 color;
+	float minSize;
+	float maxSize;
+};
+
+// Spawn parameters of an emitter policy of the CPU path (see SmokeEmitter),
+// for the wind of this frame
+template <class EmitterPolicy>
+GpuParticleEmitter MakeGpuParticleEmitter(float wind) {
+	GpuParticleEmitter emitter;
+	emitter.origin = EmitterPolicy::Origin();
+	emitter.maindir = EmitterPolicy::Direction(wind);
+	emitter.spread = EmitterPolicy::Spread();
+	emitter.life = EmitterPolicy::Life();
+	unsigned char color[4];
+	EmitterPolicy::Color(color);
+	emitter.color = glm::vec4(color[0], color[1], color[2], color[3]) / 255.0f;
+	emitter.minSize = EmitterPolicy::MinSize();
+	emitter.maxSize = EmitterPolicy::MaxSize();
+	return emitter;
+}
+
+// Box of the roof and the splash a rain drop hitting it spawns
+struct GpuParticleSplash {
+	glm::vec3 roofMin;
+	glm::vec3 roofMax;
+	float life;
+	glm::vec4 color;
+	float minSize;
+	float maxSize;
+};
+
+// Splash parameters of a splash policy of the CPU path (see SplashEmitter)
+template <class SplashPolicy>
+GpuParticleSplash MakeGpuParticleSplash(const glm::vec3& roofMin, const glm::vec3& roofMax) {
+	GpuParticleSplash splash;
+	splash.roofMin = roofMin;
+	splash.roofMax = roofMax;
+	splash.life = SplashPolicy::Life();
+	unsigned char color[4];
+	SplashPolicy::Color(color);
+	splash.color = glm::vec4(color[0], color[1], color[2], color[3]) / 255.0f;
+	splash.minSize = SplashPolicy::MinSize();
+	splash.maxSize = SplashPolicy::MaxSize();
+	return splash;
+}
+
+// SSBO binding points shared with the shaders
+enum {
+	GpuParticleBinding = 0,
+	GpuAliveBinding = 1,
+	GpuDeadBinding = 2,
+	GpuDrawBinding = 3,
+	GpuSplashParticleBinding = 4,
+	GpuSplashDeadBinding = 5,
+	// GpuParticleSorter : instance records of the CPU particles, sorted pairs
+	GpuSortInstanceBinding = 6,
+	GpuSortPairBinding = 7,
+};
+
+// Uniform locations of GpuParticleVertexShader, fixed in the shader so every
+// fragment shader it is linked with sees the same ones
+enum {
+	GpuCameraRightLocation = 0,
+	GpuCameraUpLocation = 1,
+	GpuVPLocation = 2,
+	GpuLayerLocation = 3,
+};
+
+inline GLuint LoadComputeShader(const char* compute_file_path) {
+	// Read the Compute Shader code from the file
+	std::string ComputeShaderCode;
+	std::ifstream ComputeShaderStream(compute_file_path, std::ios::in);
+	if (!ComputeShaderStream.is_open()) {
+		printf("Impossible to open %s. Are you in the right directory ?\n", compute_file_path);
+		return 0;
+	}
+	std::stringstream sstr;
+	sstr << ComputeShaderStream.rdbuf();
+	ComputeShaderCode = sstr.str();
+	ComputeShaderStream.close();
+
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+
+	// Compile Compute Shader
+	printf("Compiling shader : %s\n", compute_file_path);
+	GLuint ComputeShaderID = glCreateShader(GL_COMPUTE_SHADER);
+	char const* ComputeSourcePointer = ComputeShaderCode.c_str();
+	glShaderSource(ComputeShaderID, 1, &ComputeSourcePointer, NULL);
+	glCompileShader(ComputeShaderID);
+	glGetShaderiv(ComputeShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(ComputeShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if (InfoLogLength > 0) {
+		std::vector<char> ComputeShaderErrorMessage(InfoLogLength + 1);
+		glGetShaderInfoLog(ComputeShaderID, InfoLogLength, NULL, &ComputeShaderErrorMessage[0]);
+		printf("%s\n", &ComputeShaderErrorMessage[0]);
+	}
+
+	// Link the program
+	printf("Linking program\n");
+	GLuint ProgramID = glCreateProgram();
+	glAttachShader(ProgramID, ComputeShaderID);
+	glLinkProgram(ProgramID);
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if (InfoLogLength > 0) {
+		std::vector<char> ProgramErrorMessage(InfoLogLength + 1);
+		glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+		printf("%s\n", &ProgramErrorMessage[0]);
+	}
+
+	glDetachShader(ProgramID, ComputeShaderID);
+	glDeleteShader(ComputeShaderID);
+
+	return ProgramID;
+}
+
+// Compute programs and their uniforms, shared by all systems
+struct GpuParticlePrograms {
+	GLuint emitProgram;
+	GLuint simulateProgram;
+	GLint emitCount, emitSeed, emitOrigin, emitMaindir, emitSpread, emitLife, emitColor, emitMinSize, emitMaxSize;
+	GLint simulateDelta, simulateGravity, simulateCollide, simulateSeed;
+	GLint simulateRoofMin, simulateRoofMax, simulateSplashLife, simulateSplashColor, simulateSplashMinSize, simulateSplashMaxSize;
+
+	void Load() {
+		emitProgram = LoadComputeShader("ParticleEmitComputeShader.computeshader");
+		simulateProgram = LoadComputeShader("ParticleSimulateComputeShader.computeshader");
+		emitCount = glGetUniformLocation(emitProgram, "EmitCount");
+		emitSeed = glGetUniformLocation(emitProgram, "Seed");
+		emitOrigin = glGetUniformLocation(emitProgram, "EmitOrigin");
+		emitMaindir = glGetUniformLocation(emitProgram, "EmitMaindir");
+		emitSpread = glGetUniformLocation(emitProgram, "EmitSpread");
+		emitLife = glGetUniformLocation(emitProgram, "EmitLife");
+		emitColor = glGetUniformLocation(emitProgram, "EmitColor");
+		emitMinSize = glGetUniformLocation(emitProgram, "EmitMinSize");
+		emitMaxSize = glGetUniformLocation(emitProgram, "EmitMaxSize");
+		simulateDelta = glGetUniformLocation(simulateProgram, "Delta");
+		simulateGravity = glGetUniformLocation(simulateProgram, "Gravity");
+		simulateCollide = glGetUniformLocation(simulateProgram, "Collide");
+		simulateSeed = glGetUniformLocation(simulateProgram, "Seed");
+		simulateRoofMin = glGetUniformLocation(simulateProgram, "RoofMin");
+		simulateRoofMax = glGetUniformLocation(simulateProgram, "RoofMax");
+		simulateSplashLife = glGetUniformLocation(simulateProgram, "SplashLife");
+		simulateSplashColor = glGetUniformLocation(simulateProgram, "SplashColor");
+		simulateSplashMinSize = glGetUniformLocation(simulateProgram, "SplashMinSize");
+		simulateSplashMaxSize = glGetUniformLocation(simulateProgram, "SplashMaxSize");
+	}
+
+	void Delete() {
+		glDeleteProgram(emitProgram);
+		glDeleteProgram(simulateProgram);
+	}
+};
+
+// Buffers of one particle system
+class GpuParticleSystem {
+public:
+	GLuint particleBuffer;
+	GLuint aliveBuffer;
+	GLuint deadBuffer;
+	GLuint drawBuffer;
+	// Particle slots; the shaders read it back as the buffer length
+	int capacity;
+
+	// vertexCount is the number of vertices of one particle (triangle strip).
+	// The state never leaves the GPU, so the slots are allocated up front.
+	void Init(int vertexCount, int slots) {
+		capacity = slots;
+		// Every slot starts dead and on the free stack
+		std::vector<GpuParticle> particles(capacity);
+		for (int i = 0; i < capacity; i++) {
+			particles[i].posLife = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+		}
+		std::vector<GLuint> dead(capacity + 1);
+		dead[0] = capacity;
+		for (int i = 0; i < capacity; i++) {
+			dead[i + 1] = capacity - 1 - i;
+		}
+		GLuint draw[4] = { (GLuint)vertexCount, 0, 0, 0 };
+
+		glGenBuffers(1, &particleBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, particleBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * sizeof(GpuParticle), &particles[0], GL_DYNAMIC_DRAW);
+		glGenBuffers(1, &aliveBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, aliveBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+		glGenBuffers(1, &deadBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, deadBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (capacity + 1) * sizeof(GLuint), &dead[0], GL_DYNAMIC_DRAW);
+		glGenBuffers(1, &drawBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(draw), draw, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	// Spawn count particles
+	void Emit(const GpuParticlePrograms& programs, int count, const GpuParticleEmitter& emitter, GLuint seed) {
+		if (count <= 0) {
+			return;
+		}
+		glUseProgram(programs.emitProgram);
+		glUniform1ui(programs.emitCount, (GLuint)count);
+		glUniform1ui(programs.emitSeed, seed);
+		glUniform3f(programs.emitOrigin, emitter.origin.x, emitter.origin.y, emitter.origin.z);
+		glUniform3f(programs.emitMaindir, emitter.maindir.x, emitter.maindir.y, emitter.maindir.z);
+		glUniform1f(programs.emitSpread, emitter.spread);
+		glUniform1f(programs.emitLife, emitter.life);
+		glUniform4f(programs.emitColor, emitter.color.x, emitter.color.y, emitter.color.z, emitter.color.w);
+		glUniform1f(programs.emitMinSize, emitter.minSize);
+		glUniform1f(programs.emitMaxSize, emitter.maxSize);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuParticleBinding, particleBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuDeadBinding, deadBuffer);
+		glDispatchCompute((count + 63) / 64, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+
+	// Age and move every particle. Drops hitting the roof spawn into splashes
+	// when it is given, as described by splash.
+	void Simulate(const GpuParticlePrograms& programs, float delta, float gravity, GpuParticleSystem* splashes, const GpuParticleSplash* splash, GLuint seed) {
+		// Reset the instance count of the draw command
+		GLuint zero = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawBuffer);
+		glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, sizeof(GLuint), sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		glUseProgram(programs.simulateProgram);
+		glUniform1f(programs.simulateDelta, delta);
+		glUniform1f(programs.simulateGravity, gravity);
+		glUniform1i(programs.simulateCollide, splashes != NULL);
+		glUniform1ui(programs.simulateSeed, seed);
+		if (splashes) {
+			glUniform3f(programs.simulateRoofMin, splash->roofMin.x, splash->roofMin.y, splash->roofMin.z);
+			glUniform3f(programs.simulateRoofMax, splash->roofMax.x, splash->roofMax.y, splash->roofMax.z);
+			glUniform1f(programs.simulateSplashLife, splash->life);
+			glUniform4f(programs.simulateSplashColor, splash->color.x, splash->color.y, splash->color.z, splash->color.w);
+			glUniform1f(programs.simulateSplashMinSize, splash->minSize);
+			glUniform1f(programs.simulateSplashMaxSize, splash->maxSize);
+		}
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuParticleBinding, particleBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuAliveBinding, aliveBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuDeadBinding, deadBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuDrawBinding, drawBuffer);
+		// Splash bindings must be valid even when collisions are off
+		GpuParticleSystem* target = splashes ? splashes : this;
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuSplashParticleBinding, target->particleBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuSplashDeadBinding, target->deadBuffer);
+		glDispatchCompute((capacity + 63) / 64, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+	}
+
+	// Draw the live particles. The caller binds the program, VAO and quad.
+	void Draw(GLenum mode) {
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuParticleBinding, particleBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GpuAliveBinding, aliveBuffer);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawBuffer);
+		glDrawArraysIndirect(mode, (void*)0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+	void Delete() {
+		glDeleteBuffers(1, &particleBuffer);
+		glDeleteBuffers(1, &aliveBuffer);
+		glDeleteBuffers(1, &deadBuffer);
+		glDeleteBuffers(1, &drawBuffer);
+	}
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Every particle texture as one layer of a 2D texture array, so all particle
+// systems draw with one texture binding, and the layer of each instance is
+// picked in the shader. Layers of an array all have the same size : each
+// source texture is read back and box filtered to the size of the smallest
+// one (rain.bmp is twice the size of smoke.bmp).
+class ParticleAtlas {
+public:
+	GLuint texture;
+	// Width and height of every layer
+	int size;
+	int layers;
+
+	ParticleAtlas() : texture(0), size(0), layers(0) {
+	}
+
+	// Build the array from count loaded 2D textures, layer i from sources[i]
+	bool Init(const GLuint* sources, int count) {
+		size = 0;
+		for (int i = 0; i < count; i++) {
+			GLint width, height;
+			glBindTexture(GL_TEXTURE_2D, sources[i]);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+			if (width <= 0 || height <= 0) {
+				fprintf(stderr, "Particle texture %d is empty\n", i);
+				return false;
+			}
+			int smallest = width < height ? width : height;
+			if (size == 0 || smallest < size) {
+				size = smallest;
+			}
+		}
+		layers = count;
+		std::vector<unsigned char> pixels((size_t)size * size * 4 * layers);
+		std::vector<unsigned char> source;
+		for (int i = 0; i < count; i++) {
+			GLint width, height;
+			glBindTexture(GL_TEXTURE_2D, sources[i]);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+			source.resize((size_t)width * height * 4);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, &source[0]);
+			Downsample(&source[0], width, height, &pixels[(size_t)size * size * 4 * i]);
+		}
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, size, size, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+		// Same filtering as the textures it replaces
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		return true;
+	}
+
+	void Delete() {
+		glDeleteTextures(1, &texture);
+		texture = 0;
+	}
+
+private:
+	// Average the source texels under each of the size x size layer texels
+	void Downsample(const unsigned char* source, int width, int height, unsigned char* layer) const {
+		for (int y = 0; y < size; y++) {
+			int y0 = y * height / size;
+			int y1 = (y + 1) * height / size;
+			for (int x = 0; x < size; x++) {
+				int x0 = x * width / size;
+				int x1 = (x + 1) * width / size;
+				unsigned int sum[4] = { 0, 0, 0, 0 };
+				for (int sy = y0; sy < y1; sy++) {
+					for (int sx = x0; sx < x1; sx++) {
+						const unsigned char* texel = &source[4 * ((size_t)sy * width + sx)];
+						for (int c = 0; c < 4; c++) {
+							sum[c] += texel[c];
+						}
+					}
+				}
+				unsigned int texels = (unsigned int)((y1 - y0) * (x1 - x0));
+				for (int c = 0; c < 4; c++) {
+					layer[4 * ((size_t)y * size + x) + c] = (unsigned char)((sum[c] + texels / 2) / texels);
+				}
+			}
+		}
+	}
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+
+#include <GL/glew.h>
+
+#include "ParticlePool.h"
+
+// Keeps the frame time under targetMs by scaling the particle workload.
+// Each frame the caller reports the CPU time of the particle simulation and
+// sort and of the whole frame; the GPU time of the frame and of the particle
+// draws come from timestamp queries, read back Frames frames later so the CPU
+// never waits for them. From the frame cost and the share of it spent on
+// particles, the controller estimates the workload scale that would hit the
+// target and moves towards it by at most 5% per frame, so the
+// particles thin out and shrink gradually instead of the frame rate
+// stuttering. scale drives the emission rate, the live particle cap and the
+// size of new particles; particles already alive are left as they are.
+class ParticleBudget {
+public:
+	static const int Frames = 3;
+
+	// 0 disables the controller and keeps scale at 1
+	float targetMs;
+	float minScale;
+	float scale;
+	// Metrics of the last frame with GPU results, in milliseconds
+	float simulateMs;
+	float sortMs;
+	float drawMs;
+	float frameMs;
+	// Exponential average of max(CPU, GPU) frame time
+	float smoothedMs;
+
+	ParticleBudget() : targetMs(16.6f), minScale(0.1f), scale(1.0f), simulateMs(0.0f), sortMs(0.0f), drawMs(0.0f), frameMs(0.0f), smoothedMs(0.0f), frame(0) {
+		for (int i = 0; i < Frames; i++) {
+			issued[i] = false;
+		}
+	}
+
+	void Init() {
+		glGenQueries(Frames * QueryCount, &queries[0][0]);
+	}
+
+	void Delete() {
+		glDeleteQueries(Frames * QueryCount, &queries[0][0]);
+	}
+
+	// Call before any GL work of the frame
+	void BeginFrame() {
+		frame = (frame + 1) % Frames;
+		if (issued[frame]) {
+			// Results of the frame that used this slot Frames frames ago
+			GLint available = 0;
+			glGetQueryObjectiv(queries[frame][QueryFrameEnd], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint64 t[QueryCount];
+				for (int q = 0; q < QueryCount; q++) {
+					glGetQueryObjectui64v(queries[frame][q], GL_QUERY_RESULT, &t[q]);
+				}
+				gpuFrameMs[frame] = (t[QueryFrameEnd] - t[QueryFrameBegin]) * 1e-6f;
+				gpuDrawMs[frame] = (t[QueryDrawEnd] - t[QueryDrawBegin]) * 1e-6f;
+				Update(frame);
+			}
+		}
+		glQueryCounter(queries[frame][QueryFrameBegin], GL_TIMESTAMP);
+	}
+
+	// Around the particle draws (and compute passes on the GPU path)
+	void BeginDraw() {
+		glQueryCounter(queries[frame][QueryDrawBegin], GL_TIMESTAMP);
+	}
+
+	void EndDraw() {
+		glQueryCounter(queries[frame][QueryDrawEnd], GL_TIMESTAMP);
+	}
+
+	// Call before swapping buffers, with the CPU times of this frame. The
+	// frame time must not include the swap, which waits for vsync.
+	void EndFrame(float cpuFrameMs, float cpuSimulate, float cpuSort) {
+		glQueryCounter(queries[frame][QueryFrameEnd], GL_TIMESTAMP);
+		issued[frame] = true;
+		cpuMs[frame] = cpuFrameMs;
+		simulateTimes[frame] = cpuSimulate;
+		sortTimes[frame] = cpuSort;
+	}
+
+	// Emission of one step, scaled
+	int Emission(int count) const {
+		return (int)(count * scale);
+	}
+
+	// How many of count new particles pool may take under the live cap. At
+	// full scale there is no cap, a full pool counts its drops itself, and
+	// base follows the live count of pool. Below it, the cap is base, the
+	// live count when throttling started, times scale : the pool limit is far
+	// above what the emitters keep alive, so a cap scaled from it would never
+	// be reached.
+	int Spawns(const ParticlePool& pool, int& base, int count) const {
+		if (scale >= 1.0f) {
+			base = pool.count;
+			return count;
+		}
+		int limit = (int)(base * scale);
+		return std::max(std::min(count, limit - pool.count), 0);
+	}
+
+	// Size factor of new particles. Smaller particles cost less fill rate,
+	// but not below half size so they stay visible.
+	float SizeScale() const {
+		return 0.5f + 0.5f * scale;
+	}
+
+private:
+	enum { QueryFrameBegin, QueryDrawBegin, QueryDrawEnd, QueryFrameEnd, QueryCount };
+
+	GLuint queries[Frames][QueryCount];
+	bool issued[Frames];
+	int frame;
+	float cpuMs[Frames];
+	float simulateTimes[Frames];
+	float sortTimes[Frames];
+	float gpuFrameMs[Frames];
+	float gpuDrawMs[Frames];
+
+	void Update(int slot) {
+		simulateMs = simulateTimes[slot];
+		sortMs = sortTimes[slot];
+		drawMs = gpuDrawMs[slot];
+		frameMs = std::max(cpuMs[slot], gpuFrameMs[slot]);
+		smoothedMs = smoothedMs == 0.0f ? frameMs : smoothedMs + 0.1f * (frameMs - smoothedMs);
+		if (targetMs <= 0.0f) {
+			scale = 1.0f;
+			return;
+		}
+		// Particle cost is about proportional to scale : remove the excess
+		// from it, or give back the spare time
+		float particleMs = std::max(simulateMs + sortMs + drawMs, 0.1f);
+		float wanted = scale * (1.0f - (frameMs - targetMs) / particleMs);
+		wanted = std::min(std::max(wanted, minScale), 1.0f);
+		// Results are Frames frames old : only go a quarter of the way, and at
+		// most 5% per frame, or the scale oscillates around the target
+		scale += std::min(std::max(0.25f * (wanted - scale), -0.05f), 0.05f);
+	}
+};
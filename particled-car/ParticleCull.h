@@ -0,0 +1,148 @@
+#pragma once
+
+#include <math.h>
+#include <float.h>
+
+#include <immintrin.h>
+
+#include <glm/glm.hpp>
+
+#include "ParticleKernel.h"
+
+// View frustum culling of particles.
+// The six planes come straight from the rows of the view-projection matrix
+// (Gribb and Hartmann), normalized so that a * x + b * y + c * z + d is the
+// distance of a point to the plane, positive inside. A particle is a
+// sphere around its staged center, of radius its size times the bounding
+// radius of its quad, so billboards facing any way are kept whole.
+struct ParticleFrustum {
+	enum Result { Outside, Intersecting, Inside };
+
+	float planes[6][4];
+
+	void Extract(const glm::mat4& vp) {
+		for (int p = 0; p < 6; p++) {
+			// Left, right, bottom, top, near, far : row 3 +/- row 0, 1, 2
+			int axis = p / 2;
+			float sign = (p & 1) ? -1.0f : 1.0f;
+			for (int k = 0; k < 4; k++) {
+				planes[p][k] = vp[k][3] + sign * vp[k][axis];
+			}
+			float length = sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+			for (int k = 0; k < 4; k++) {
+				planes[p][k] /= length;
+			}
+		}
+	}
+
+	// Whole box outside one plane, inside all of them, or neither
+	Result TestBox(const glm::vec3& lo, const glm::vec3& hi) const {
+		Result result = Inside;
+		for (int p = 0; p < 6; p++) {
+			const float* n = planes[p];
+			// Corner furthest along the normal, and the one furthest against it
+			float outer = n[0] * (n[0] >= 0.0f ? hi.x : lo.x) + n[1] * (n[1] >= 0.0f ? hi.y : lo.y) + n[2] * (n[2] >= 0.0f ? hi.z : lo.z) + n[3];
+			float inner = n[0] * (n[0] >= 0.0f ? lo.x : hi.x) + n[1] * (n[1] >= 0.0f ? lo.y : hi.y) + n[2] * (n[2] >= 0.0f ? lo.z : hi.z) + n[3];
+			if (outer < 0.0f) {
+				return Outside;
+			}
+			if (inner < 0.0f) {
+				result = Intersecting;
+			}
+		}
+		return result;
+	}
+};
+
+// Bounding radius of a particle quad of size 1, from its vertices
+inline float ParticleQuadRadius(const float* vertices, int vertexCount) {
+	float radius = 0.0f;
+	for (int i = 0; i < vertexCount; i++) {
+		const float* v = &vertices[3 * i];
+		radius = fmaxf(radius, sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]));
+	}
+	return radius;
+}
+
+// Box around the first count staged particles, grown by the largest of their
+// radii. Dead particles are included, the box is only a bound.
+inline void ParticleBounds(const float* staging, int count, float quadRadius, glm::vec3& lo, glm::vec3& hi) {
+	__m128 low = _mm_set1_ps(FLT_MAX);
+	__m128 high = _mm_set1_ps(-FLT_MAX);
+	for (int i = 0; i < count; i++) {
+		// One xyzs record : the w lane ends up with the largest size
+		__m128 record = _mm_loadu_ps(&staging[4 * i]);
+		low = _mm_min_ps(low, record);
+		high = _mm_max_ps(high, record);
+	}
+	float l[4], h[4];
+	_mm_storeu_ps(l, low);
+	_mm_storeu_ps(h, high);
+	float radius = h[3] * quadRadius;
+	lo = glm::vec3(l[0] - radius, l[1] - radius, l[2] - radius);
+	hi = glm::vec3(h[0] + radius, h[1] + radius, h[2] + radius);
+}
+
+// Culling kernel.
+// For every particle in [begin, end) : visible[i] = 1 when it is alive
+// (cameradistance >= 0) and its sphere touches the frustum, else 0.
+// Returns how many are visible.
+typedef int (*ParticleCuller)(const float* staging, const float* cameradistance, int begin, int end, const ParticleFrustum& frustum, float quadRadius, unsigned char* visible);
+
+inline int CullParticlesScalar(const float* staging, const float* cameradistance, int begin, int end, const ParticleFrustum& frustum, float quadRadius, unsigned char* visible) {
+	int count = 0;
+	for (int i = begin; i < end; i++) {
+		const float* s = &staging[4 * i];
+		float radius = -s[3] * quadRadius;
+		bool inside = cameradistance[i] >= 0.0f;
+		for (int p = 0; p < 6 && inside; p++) {
+			const float* n = frustum.planes[p];
+			inside = (n[0] * s[0] + n[1] * s[1]) + (n[2] * s[2] + n[3]) > radius;
+		}
+		visible[i] = inside ? 1 : 0;
+		count += inside ? 1 : 0;
+	}
+	return count;
+}
+
+// SSE4.2 version, 4 particles per iteration. The staged xyzs records are
+// transposed to x, y, z, size vectors, then tested against every plane.
+PARTICLE_TARGET_SSE42
+inline int CullParticlesSSE(const float* staging, const float* cameradistance, int begin, int end, const ParticleFrustum& frustum, float quadRadius, unsigned char* visible) {
+	__m128 nx[6], ny[6], nz[6], nd[6];
+	for (int p = 0; p < 6; p++) {
+		nx[p] = _mm_set1_ps(frustum.planes[p][0]);
+		ny[p] = _mm_set1_ps(frustum.planes[p][1]);
+		nz[p] = _mm_set1_ps(frustum.planes[p][2]);
+		nd[p] = _mm_set1_ps(frustum.planes[p][3]);
+	}
+	const __m128 negativeRadius = _mm_set1_ps(-quadRadius);
+	const __m128 zero = _mm_setzero_ps();
+	int count = 0;
+	int i = begin;
+	for (; i + 4 <= end; i += 4) {
+		__m128 x = _mm_loadu_ps(&staging[4 * i + 0]);
+		__m128 y = _mm_loadu_ps(&staging[4 * i + 4]);
+		__m128 z = _mm_loadu_ps(&staging[4 * i + 8]);
+		__m128 s = _mm_loadu_ps(&staging[4 * i + 12]);
+		_MM_TRANSPOSE4_PS(x, y, z, s);
+		__m128 radius = _mm_mul_ps(s, negativeRadius);
+		__m128 inside = _mm_cmpge_ps(_mm_loadu_ps(&cameradistance[i]), zero);
+		for (int p = 0; p < 6; p++) {
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], x), _mm_mul_ps(ny[p], y)), _mm_add_ps(_mm_mul_ps(nz[p], z), nd[p]));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, radius));
+		}
+		int mask = _mm_movemask_ps(inside);
+		visible[i + 0] = (unsigned char)(mask & 1);
+		visible[i + 1] = (unsigned char)((mask >> 1) & 1);
+		visible[i + 2] = (unsigned char)((mask >> 2) & 1);
+		visible[i + 3] = (unsigned char)((mask >> 3) & 1);
+		count += _mm_popcnt_u32(mask);
+	}
+	return count + CullParticlesScalar(staging, cameradistance, i, end, frustum, quadRadius, visible);
+}
+
+// Pick the culling kernel the CPU supports
+inline ParticleCuller SelectParticleCuller() {
+	return DetectParticleSimd() == ParticleSimdScalar ? CullParticlesScalar : CullParticlesSSE;
+}
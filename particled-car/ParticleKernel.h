@@ -0,0 +1,293 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PARTICLE_TARGET_SSE42
+#define PARTICLE_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define PARTICLE_TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+#define PARTICLE_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#endif
+
+#include <glm/glm.hpp>
+
+#include "ParticlePool.h"
+
+// Particle integration kernel.
+// For every particle in [begin, end) : decrease life, apply gravity, move it,
+// compute its squared distance to the camera (-1 when it just died) and write
+// x, y, z, size into the staging array at the same index.
+// Returns how many of those particles are still alive.
+typedef int (*ParticleKernel)(ParticlePool& pool, int begin, int end, float delta, float gravity, const glm::vec3& camera, float* staging);
+
+inline int SimulateParticlesScalar(ParticlePool& pool, int begin, int end, float delta, float gravity, const glm::vec3& camera, float* staging) {
+	float gravityStep = gravity * delta * 0.5f;
+	int alive = 0;
+	for (int i = begin; i < end; i++) {
+		pool.life[i] -= delta;
+		pool.speedY[i] += gravityStep;
+		pool.posX[i] += pool.speedX[i] * delta;
+		pool.posY[i] += pool.speedY[i] * delta;
+		pool.posZ[i] += pool.speedZ[i] * delta;
+		float dx = pool.posX[i] - camera.x;
+		float dy = pool.posY[i] - camera.y;
+		float dz = pool.posZ[i] - camera.z;
+		if (pool.life[i] > 0.0f) {
+			pool.cameradistance[i] = dx * dx + dy * dy + dz * dz;
+			alive++;
+		}
+		else {
+			pool.cameradistance[i] = -1.0f;
+		}
+		staging[4 * i + 0] = pool.posX[i];
+		staging[4 * i + 1] = pool.posY[i];
+		staging[4 * i + 2] = pool.posZ[i];
+		staging[4 * i + 3] = pool.size[i];
+	}
+	return alive;
+}
+
+// SSE4.2 version, 8 particles per iteration as two groups of 4
+PARTICLE_TARGET_SSE42
+inline int SimulateParticlesSSE(ParticlePool& pool, int begin, int end, float delta, float gravity, const glm::vec3& camera, float* staging) {
+	const __m128 dt = _mm_set1_ps(delta);
+	const __m128 gravityStep = _mm_set1_ps(gravity * delta * 0.5f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 dead = _mm_set1_ps(-1.0f);
+	const __m128 cx = _mm_set1_ps(camera.x);
+	const __m128 cy = _mm_set1_ps(camera.y);
+	const __m128 cz = _mm_set1_ps(camera.z);
+	int alive = 0;
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		for (int j = i; j < i + 8; j += 4) {
+			__m128 life = _mm_sub_ps(_mm_loadu_ps(&pool.life[j]), dt);
+			__m128 vy = _mm_add_ps(_mm_loadu_ps(&pool.speedY[j]), gravityStep);
+			__m128 px = _mm_add_ps(_mm_loadu_ps(&pool.posX[j]), _mm_mul_ps(_mm_loadu_ps(&pool.speedX[j]), dt));
+			__m128 py = _mm_add_ps(_mm_loadu_ps(&pool.posY[j]), _mm_mul_ps(vy, dt));
+			__m128 pz = _mm_add_ps(_mm_loadu_ps(&pool.posZ[j]), _mm_mul_ps(_mm_loadu_ps(&pool.speedZ[j]), dt));
+			__m128 dx = _mm_sub_ps(px, cx);
+			__m128 dy = _mm_sub_ps(py, cy);
+			__m128 dz = _mm_sub_ps(pz, cz);
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			__m128 isAlive = _mm_cmpgt_ps(life, zero);
+			alive += _mm_popcnt_u32(_mm_movemask_ps(isAlive));
+			_mm_storeu_ps(&pool.life[j], life);
+			_mm_storeu_ps(&pool.speedY[j], vy);
+			_mm_storeu_ps(&pool.posX[j], px);
+			_mm_storeu_ps(&pool.posY[j], py);
+			_mm_storeu_ps(&pool.posZ[j], pz);
+			_mm_storeu_ps(&pool.cameradistance[j], _mm_blendv_ps(dead, distance, isAlive));
+			// Transpose x, y, z, size into 4 xyzs records
+			__m128 size = _mm_loadu_ps(&pool.size[j]);
+			_MM_TRANSPOSE4_PS(px, py, pz, size);
+			_mm_storeu_ps(&staging[4 * j + 0], px);
+			_mm_storeu_ps(&staging[4 * j + 4], py);
+			_mm_storeu_ps(&staging[4 * j + 8], pz);
+			_mm_storeu_ps(&staging[4 * j + 12], size);
+		}
+	}
+	return alive + SimulateParticlesScalar(pool, i, end, delta, gravity, camera, staging);
+}
+
+// AVX2 version, 8 particles per iteration
+PARTICLE_TARGET_AVX2
+inline int SimulateParticlesAVX2(ParticlePool& pool, int begin, int end, float delta, float gravity, const glm::vec3& camera, float* staging) {
+	const __m256 dt = _mm256_set1_ps(delta);
+	const __m256 gravityStep = _mm256_set1_ps(gravity * delta * 0.5f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 dead = _mm256_set1_ps(-1.0f);
+	const __m256 cx = _mm256_set1_ps(camera.x);
+	const __m256 cy = _mm256_set1_ps(camera.y);
+	const __m256 cz = _mm256_set1_ps(camera.z);
+	int alive = 0;
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 life = _mm256_sub_ps(_mm256_loadu_ps(&pool.life[i]), dt);
+		__m256 vy = _mm256_add_ps(_mm256_loadu_ps(&pool.speedY[i]), gravityStep);
+		__m256 px = _mm256_add_ps(_mm256_loadu_ps(&pool.posX[i]), _mm256_mul_ps(_mm256_loadu_ps(&pool.speedX[i]), dt));
+		__m256 py = _mm256_add_ps(_mm256_loadu_ps(&pool.posY[i]), _mm256_mul_ps(vy, dt));
+		__m256 pz = _mm256_add_ps(_mm256_loadu_ps(&pool.posZ[i]), _mm256_mul_ps(_mm256_loadu_ps(&pool.speedZ[i]), dt));
+		__m256 dx = _mm256_sub_ps(px, cx);
+		__m256 dy = _mm256_sub_ps(py, cy);
+		__m256 dz = _mm256_sub_ps(pz, cz);
+		// No FMA here, so results match the scalar loop bit for bit
+		__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+		__m256 isAlive = _mm256_cmp_ps(life, zero, _CMP_GT_OQ);
+		alive += _mm_popcnt_u32(_mm256_movemask_ps(isAlive));
+		_mm256_storeu_ps(&pool.life[i], life);
+		_mm256_storeu_ps(&pool.speedY[i], vy);
+		_mm256_storeu_ps(&pool.posX[i], px);
+		_mm256_storeu_ps(&pool.posY[i], py);
+		_mm256_storeu_ps(&pool.posZ[i], pz);
+		_mm256_storeu_ps(&pool.cameradistance[i], _mm256_blendv_ps(dead, distance, isAlive));
+		// Transpose x, y, z, size into 8 xyzs records, one 128 bit lane at a time
+		__m256 size = _mm256_loadu_ps(&pool.size[i]);
+		__m128 lowX = _mm256_castps256_ps128(px), lowY = _mm256_castps256_ps128(py);
+		__m128 lowZ = _mm256_castps256_ps128(pz), lowS = _mm256_castps256_ps128(size);
+		__m128 highX = _mm256_extractf128_ps(px, 1), highY = _mm256_extractf128_ps(py, 1);
+		__m128 highZ = _mm256_extractf128_ps(pz, 1), highS = _mm256_extractf128_ps(size, 1);
+		_MM_TRANSPOSE4_PS(lowX, lowY, lowZ, lowS);
+		_MM_TRANSPOSE4_PS(highX, highY, highZ, highS);
+		_mm256_storeu_ps(&staging[4 * i + 0], _mm256_set_m128(lowY, lowX));
+		_mm256_storeu_ps(&staging[4 * i + 8], _mm256_set_m128(lowS, lowZ));
+		_mm256_storeu_ps(&staging[4 * i + 16], _mm256_set_m128(highY, highX));
+		_mm256_storeu_ps(&staging[4 * i + 24], _mm256_set_m128(highS, highZ));
+	}
+	return alive + SimulateParticlesScalar(pool, i, end, delta, gravity, camera, staging);
+}
+
+// Rewrite the staging records of the live particles in [begin, end) with
+// their position back seconds before the last step, position - speed * back,
+// and their camera distance from there. With a fixed timestep this draws the
+// particles between the last two steps.
+inline void StageInterpolatedParticles(ParticlePool& pool, int begin, int end, float back, const glm::vec3& camera, float* staging) {
+	for (int i = begin; i < end; i++) {
+		if (pool.cameradistance[i] < 0.0f) {
+			continue;
+		}
+		float x = pool.posX[i] - pool.speedX[i] * back;
+		float y = pool.posY[i] - pool.speedY[i] * back;
+		float z = pool.posZ[i] - pool.speedZ[i] * back;
+		float dx = x - camera.x, dy = y - camera.y, dz = z - camera.z;
+		pool.cameradistance[i] = dx * dx + dy * dy + dz * dz;
+		staging[4 * i + 0] = x;
+		staging[4 * i + 1] = y;
+		staging[4 * i + 2] = z;
+		staging[4 * i + 3] = pool.size[i];
+	}
+}
+
+// Widest instruction set the CPU and OS support, among the ones the particle
+// code has versions for
+enum ParticleSimd {
+	ParticleSimdScalar,
+	ParticleSimdSSE42,
+	ParticleSimdAVX2,
+};
+
+inline ParticleSimd DetectParticleSimd() {
+	int info[4] = { 0, 0, 0, 0 };
+	bool sse42 = false, popcnt = false, avx = false, avx2 = false;
+#if defined(_MSC_VER)
+	__cpuid(info, 1);
+#else
+	__cpuid(1, info[0], info[1], info[2], info[3]);
+#endif
+	sse42 = (info[2] & (1 << 20)) != 0;
+	popcnt = (info[2] & (1 << 23)) != 0;
+	// AVX needs the OS to save the YMM registers (OSXSAVE + XCR0 bits 1 and 2)
+	if ((info[2] & (1 << 27)) && (info[2] & (1 << 28))) {
+#if defined(_MSC_VER)
+		unsigned long long xcr0 = _xgetbv(0);
+#else
+		unsigned int xcrLow, xcrHigh;
+		__asm__("xgetbv" : "=a"(xcrLow), "=d"(xcrHigh) : "c"(0));
+		unsigned long long xcr0 = ((unsigned long long)xcrHigh << 32) | xcrLow;
+#endif
+		avx = (xcr0 & 6) == 6;
+	}
+	if (avx) {
+#if defined(_MSC_VER)
+		__cpuidex(info, 7, 0);
+#else
+		__cpuid_count(7, 0, info[0], info[1], info[2], info[3]);
+#endif
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+	if (avx2 && popcnt) {
+		return ParticleSimdAVX2;
+	}
+	if (sse42 && popcnt) {
+		return ParticleSimdSSE42;
+	}
+	return ParticleSimdScalar;
+}
+
+// Pick the widest kernel the CPU and OS support
+inline ParticleKernel SelectParticleKernel() {
+	switch (DetectParticleSimd()) {
+	case ParticleSimdAVX2:
+		printf("Particle kernel : AVX2\n");
+		return SimulateParticlesAVX2;
+	case ParticleSimdSSE42:
+		printf("Particle kernel : SSE4.2\n");
+		return SimulateParticlesSSE;
+	default:
+		printf("Particle kernel : scalar\n");
+		return SimulateParticlesScalar;
+	}
+}
+
+// Largest relative difference between two float arrays
+inline float MaxRelativeError(const float* a, const float* b, int n) {
+	float worst = 0.0f;
+	for (int i = 0; i < n; i++) {
+		float error = fabsf(a[i] - b[i]) / fmaxf(fabsf(a[i]), 1.0f);
+		worst = fmaxf(worst, error);
+	}
+	return worst;
+}
+
+// Whether two float arrays hold the same bits
+inline bool SameFloats(const float* a, const float* b, int n) {
+	return memcmp(a, b, n * sizeof(float)) == 0;
+}
+
+// Run the selected kernel and the scalar loop on the same random particles
+// and compare the results. The vector kernels use the same operation order and
+// no FMA, so they must match bit for bit : a replay recorded with one kernel
+// is checked against a run with another. The relative error is only reported.
+inline bool ValidateParticleKernel(ParticleKernel kernel) {
+	static ParticlePool reference, tested;
+	const int n = 1003;
+	static float referenceStaging[n * 4], testedStaging[n * 4];
+	reference.Reserve(n);
+	tested.Reserve(n);
+	for (int i = 0; i < n; i++) {
+		reference.life[i] = (rand() % 1000) / 2000.0f - 0.05f;
+		reference.SetPosition(i, glm::vec3((rand() % 2000 - 1000.0f) / 1000.0f, (rand() % 2000 - 1000.0f) / 1000.0f, (rand() % 2000 - 1000.0f) / 1000.0f));
+		reference.SetSpeed(i, glm::vec3((rand() % 2000 - 1000.0f) / 100.0f, (rand() % 2000 - 1000.0f) / 100.0f, (rand() % 2000 - 1000.0f) / 100.0f));
+		reference.size[i] = (rand() % 1000) / 2000.0f + 0.1f;
+	}
+	memcpy(tested.life, reference.life, n * sizeof(float));
+	memcpy(tested.posX, reference.posX, n * sizeof(float));
+	memcpy(tested.posY, reference.posY, n * sizeof(float));
+	memcpy(tested.posZ, reference.posZ, n * sizeof(float));
+	memcpy(tested.speedX, reference.speedX, n * sizeof(float));
+	memcpy(tested.speedY, reference.speedY, n * sizeof(float));
+	memcpy(tested.speedZ, reference.speedZ, n * sizeof(float));
+	memcpy(tested.size, reference.size, n * sizeof(float));
+	glm::vec3 camera(0.5f, 1.0f, 4.0f);
+	// Start at 1 so an unaligned head and a scalar tail are both covered
+	int referenceAlive = SimulateParticlesScalar(reference, 1, n, 0.016f, -9.81f, camera, referenceStaging);
+	int testedAlive = kernel(tested, 1, n, 0.016f, -9.81f, camera, testedStaging);
+	float error = 0.0f;
+	error = fmaxf(error, MaxRelativeError(&reference.posX[1], &tested.posX[1], n - 1));
+	error = fmaxf(error, MaxRelativeError(&reference.posY[1], &tested.posY[1], n - 1));
+	error = fmaxf(error, MaxRelativeError(&reference.posZ[1], &tested.posZ[1], n - 1));
+	error = fmaxf(error, MaxRelativeError(&reference.speedY[1], &tested.speedY[1], n - 1));
+	error = fmaxf(error, MaxRelativeError(&reference.life[1], &tested.life[1], n - 1));
+	error = fmaxf(error, MaxRelativeError(&reference.cameradistance[1], &tested.cameradistance[1], n - 1));
+	error = fmaxf(error, MaxRelativeError(&referenceStaging[4], &testedStaging[4], (n - 1) * 4));
+	bool same = SameFloats(&reference.posX[1], &tested.posX[1], n - 1)
+		&& SameFloats(&reference.posY[1], &tested.posY[1], n - 1)
+		&& SameFloats(&reference.posZ[1], &tested.posZ[1], n - 1)
+		&& SameFloats(&reference.speedY[1], &tested.speedY[1], n - 1)
+		&& SameFloats(&reference.life[1], &tested.life[1], n - 1)
+		&& SameFloats(&reference.cameradistance[1], &tested.cameradistance[1], n - 1)
+		&& SameFloats(&referenceStaging[4], &testedStaging[4], (n - 1) * 4);
+	if (referenceAlive != testedAlive || !same) {
+		fprintf(stderr, "Particle kernel does not match the scalar loop (alive %d vs %d, error %g)\n", testedAlive, referenceAlive, error);
+		return false;
+	}
+	printf("Particle kernel matches the scalar loop exactly\n");
+	return true;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <common/shader.hpp>
+
+// Particles blended at a fraction of the screen resolution (--particle-res N,
+// N = 2 or 4, P key), for N * N times fewer blended fragments (Nguyen, GPU
+// Gems 3 ch. 23). Soft smoke loses nothing visible at half resolution.
+// Begin() copies the scene depth and keeps the farthest depth of every
+// N x N block in a small depth buffer, which the particles are tested
+// against. A block is only hidden when all of it is in front of them. The
+// particles blend into a premultiplied color target : color weighted by
+// alpha, alpha as the coverage. Resolve() scales it up over the scene. Where
+// the four low resolution pixels around a screen pixel lie at the same depth
+// as it, they are filtered bilinearly. Across a depth edge, the one closest
+// in depth to the pixel is taken, so the particles stop at the car outline
+// instead of bleeding over it.
+class ParticleLowRes {
+public:
+	// Screen pixels per low resolution pixel, along x and y
+	int divisor;
+
+	ParticleLowRes() : divisor(1), width(0), height(0), lowWidth(0), lowHeight(0), depthFramebuffer(0), particleFramebuffer(0),
+		sceneDepthTexture(0), depthTexture(0), colorTexture(0), downsampleProgram(0), upsampleProgram(0), vertexArray(0) {
+	}
+
+	void Init() {
+		// Both passes draw the screen triangle of the OIT resolve
+		downsampleProgram = LoadShaders("ParticleOITResolveVertexShader.vertexshader", "ParticleDepthDownsampleFragmentShader.fragmentshader");
+		glUseProgram(downsampleProgram);
+		glUniform1i(glGetUniformLocation(downsampleProgram, "sceneDepthSampler"), 0);
+		downsampleLowSizeLocation = glGetUniformLocation(downsampleProgram, "LowSize");
+		upsampleProgram = LoadShaders("ParticleOITResolveVertexShader.vertexshader", "ParticleUpsampleFragmentShader.fragmentshader");
+		glUseProgram(upsampleProgram);
+		glUniform1i(glGetUniformLocation(upsampleProgram, "particleColorSampler"), 0);
+		glUniform1i(glGetUniformLocation(upsampleProgram, "particleDepthSampler"), 1);
+		glUniform1i(glGetUniformLocation(upsampleProgram, "sceneDepthSampler"), 2);
+		projectionLocation = glGetUniformLocation(upsampleProgram, "ParticleProjection");
+		glGenVertexArrays(1, &vertexArray);
+		glGenFramebuffers(1, &depthFramebuffer);
+		glGenFramebuffers(1, &particleFramebuffer);
+		glGenTextures(1, &sceneDepthTexture);
+		glGenTextures(1, &depthTexture);
+		glGenTextures(1, &colorTexture);
+	}
+
+	// Redirect particle drawing to the low resolution target. w and h are the
+	// size of the default framebuffer. Leaves blending set for the particles.
+	void Begin(int w, int h) {
+		if (w != width || h != height || (w + divisor - 1) / divisor != lowWidth || (h + divisor - 1) / divisor != lowHeight) {
+			Resize(w, h);
+		}
+		// Scene depth at full resolution, which the upsample compares against
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, depthFramebuffer);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+		// Farthest depth of every block into the particle depth buffer
+		glBindFramebuffer(GL_FRAMEBUFFER, particleFramebuffer);
+		glViewport(0, 0, lowWidth, lowHeight);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthFunc(GL_ALWAYS);
+		glDisable(GL_BLEND);
+		glUseProgram(downsampleProgram);
+		glUniform2f(downsampleLowSizeLocation, (float)lowWidth, (float)lowHeight);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, sceneDepthTexture);
+		glBindVertexArray(vertexArray);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glDepthFunc(GL_LESS);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		static const GLfloat colorClear[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		glClearBufferfv(GL_COLOR, 0, colorClear);
+
+		// Color blended as usual, alpha accumulated as coverage
+		glDepthMask(GL_FALSE);
+		glEnable(GL_BLEND);
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	}
+
+	// Composite the particles over the scene in the default framebuffer.
+	// projection is the one the particles were drawn with.
+	void Resolve(const glm::mat4& projection) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, width, height);
+		glDepthMask(GL_TRUE);
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		glUseProgram(upsampleProgram);
+		glUniform2f(projectionLocation, projection[2][2], projection[3][2]);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, sceneDepthTexture);
+		glBindVertexArray(vertexArray);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glActiveTexture(GL_TEXTURE0);
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	void Delete() {
+		glDeleteProgram(downsampleProgram);
+		glDeleteProgram(upsampleProgram);
+		glDeleteVertexArrays(1, &vertexArray);
+		glDeleteFramebuffers(1, &depthFramebuffer);
+		glDeleteFramebuffers(1, &particleFramebuffer);
+		glDeleteTextures(1, &sceneDepthTexture);
+		glDeleteTextures(1, &depthTexture);
+		glDeleteTextures(1, &colorTexture);
+	}
+
+private:
+	int width, height;
+	int lowWidth, lowHeight;
+	// Full resolution copy of the scene depth
+	GLuint depthFramebuffer;
+	// Low resolution particle color and depth
+	GLuint particleFramebuffer;
+	GLuint sceneDepthTexture;
+	GLuint depthTexture;
+	GLuint colorTexture;
+	GLuint downsampleProgram;
+	GLuint upsampleProgram;
+	GLint downsampleLowSizeLocation;
+	GLint projectionLocation;
+	GLuint vertexArray;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		lowWidth = (w + divisor - 1) / divisor;
+		lowHeight = (h + divisor - 1) / divisor;
+		// Same format as the default depth buffer, which the blit requires
+		glBindTexture(GL_TEXTURE_2D, sceneDepthTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, lowWidth, lowHeight, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		// Filtered by the bilinear upsample
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, lowWidth, lowHeight, 0, GL_RGBA, GL_HALF_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, depthFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, sceneDepthTexture, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "Scene depth framebuffer is incomplete\n");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, particleFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "Low resolution particle framebuffer is incomplete\n");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <GL/glew.h>
+#include <common/shader.hpp>
+
+// Weighted blended order independent transparency (McGuire and Bavoil 2013).
+// Particles are drawn in any order into two offscreen targets:
+//   accum  (RGBA16F) rgb = sum of color * alpha * weight, a = product of (1 - alpha)
+//   weight (R16F)    r   = sum of alpha * weight
+// One blend function serves both targets, so OpenGL 3.3 is enough : RGB
+// channels are added (ONE, ONE) and alpha is multiplied (ZERO, ONE_MINUS_SRC_ALPHA).
+// Resolve() then composites the weighted average color over the scene.
+// The targets share a copy of the scene depth, so particles behind the car
+// are still hidden, but particles never write depth.
+class ParticleOIT {
+public:
+	ParticleOIT() : width(0), height(0), framebuffer(0), accumTexture(0), weightTexture(0), depthBuffer(0), program(0), vertexArray(0) {
+	}
+
+	void Init() {
+		program = LoadShaders("ParticleOITResolveVertexShader.vertexshader", "ParticleOITResolveFragmentShader.fragmentshader");
+		glUseProgram(program);
+		glUniform1i(glGetUniformLocation(program, "accumTextureSampler"), 0);
+		glUniform1i(glGetUniformLocation(program, "weightTextureSampler"), 1);
+		// The resolve triangle has no attributes, but core profile wants a VAO
+		glGenVertexArrays(1, &vertexArray);
+		glGenFramebuffers(1, &framebuffer);
+		glGenTextures(1, &accumTexture);
+		glGenTextures(1, &weightTexture);
+		glGenRenderbuffers(1, &depthBuffer);
+	}
+
+	// Redirect particle drawing to the OIT targets. width and height are the
+	// size of the default framebuffer.
+	void Begin(int w, int h) {
+		if (w != width || h != height) {
+			Resize(w, h);
+		}
+		// Scene depth, so the car still hides particles behind it
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+		static const GLfloat accumClear[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+		static const GLfloat weightClear[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		glClearBufferfv(GL_COLOR, 0, accumClear);
+		glClearBufferfv(GL_COLOR, 1, weightClear);
+
+		glDepthMask(GL_FALSE);
+		glEnable(GL_BLEND);
+		glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+	}
+
+	// Composite the particles over the scene in the default framebuffer
+	void Resolve() {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDepthMask(GL_TRUE);
+		glDisable(GL_DEPTH_TEST);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glUseProgram(program);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, accumTexture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, weightTexture);
+		glBindVertexArray(vertexArray);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glActiveTexture(GL_TEXTURE0);
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	void Delete() {
+		glDeleteProgram(program);
+		glDeleteVertexArrays(1, &vertexArray);
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteTextures(1, &accumTexture);
+		glDeleteTextures(1, &weightTexture);
+		glDeleteRenderbuffers(1, &depthBuffer);
+	}
+
+private:
+	int width, height;
+	GLuint framebuffer;
+	GLuint accumTexture;
+	GLuint weightTexture;
+	GLuint depthBuffer;
+	GLuint program;
+	GLuint vertexArray;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		glBindTexture(GL_TEXTURE_2D, accumTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_HALF_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, weightTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, width, height, 0, GL_RED, GL_HALF_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		// Same format as the default depth buffer, which the blit requires
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, weightTexture, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+		static const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "OIT framebuffer is incomplete\n");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Pools grow and shrink by whole chunks of this many particles
+const int ParticlePoolChunk = 16384;
+// Default limit of the particles of one pool (--max-particles N)
+const int DefaultParticleLimit = 1 << 20;
+
+// Resize an array kept per particle of a pool to its capacity. The first
+// elements are kept, and shrinking really gives the memory back.
+template <class T>
+void FitParticleArray(std::vector<T>& v, int capacity) {
+	if ((int)v.size() < capacity) {
+		v.resize(capacity);
+	}
+	else if ((int)v.size() > capacity) {
+		std::vector<T>(v.begin(), v.begin() + capacity).swap(v);
+	}
+}
+
+// Growable particle pool, stored as structure of arrays.
+// Live particles always occupy the dense prefix [0, count), so the free slots
+// are the stack [count, capacity) and allocating one is a single bump.
+// Fields read by the per frame update (position, speed, life, size and camera
+// distance) each live in their own contiguous array. Color, angle and weight
+// are only written at spawn time and are kept apart so they never share cache
+// lines with the hot data.
+// Capacity is a whole number of ParticlePoolChunk chunks, up to limit. A full
+// pool grows by half its capacity, at least one chunk, so filling it copies
+// each particle a bounded number of times; Trim() gives chunks back once the
+// live count stayed well below the capacity for a while. The arrays stay
+// contiguous, so kernels and sorts index them directly, and a resize moves
+// the live prefix once into a new allocation.
+struct ParticlePool {
+	static const int Fields = 12;
+	// Trim() calls in a row with the pool under half full before it shrinks
+	static const int TrimDelay = 120;
+
+	// Hot data
+	float* posX;
+	float* posY;
+	float* posZ;
+	float* speedX;
+	float* speedY;
+	float* speedZ;
+	float* life;
+	float* size;
+	float* cameradistance;
+	// Cold data
+	unsigned char* color;
+	float* angle;
+	float* weight;
+
+	int count;
+	int capacity;
+	// Most particles the pool may grow to
+	int limit;
+	// Number of spawns refused because the pool was at its limit
+	int dropped;
+
+	ParticlePool() : posX(NULL), posY(NULL), posZ(NULL), speedX(NULL), speedY(NULL), speedZ(NULL), life(NULL), size(NULL), cameradistance(NULL),
+		color(NULL), angle(NULL), weight(NULL), count(0), capacity(0), limit(DefaultParticleLimit), dropped(0), underused(0), storage(NULL) {
+	}
+
+	~ParticlePool() {
+		free(storage);
+	}
+
+	// Returns the index of a free slot, or -1 when the pool is at its limit
+	int Allocate() {
+		if (count >= capacity && !Reserve(count + 1)) {
+			dropped++;
+			return -1;
+		}
+		return count++;
+	}
+
+	// Allocate up to n consecutive slots and return the first one. n is cut
+	// down to the slots left under the limit, the rest is counted in dropped.
+	int AllocateBlock(int& n) {
+		Reserve(count + n);
+		int available = capacity - count;
+		if (n > available) {
+			dropped += n - available;
+			n = available;
+		}
+		int first = count;
+		count += n;
+		return first;
+	}
+
+	// Grow to hold n particles, in whole chunks. Returns false when n is over
+	// the limit; the pool still grows as far as it can.
+	bool Reserve(int n) {
+		if (n <= capacity) {
+			return true;
+		}
+		if (capacity >= limit) {
+			return false;
+		}
+		int wanted = n > capacity + capacity / 2 ? n : capacity + capacity / 2;
+		int grown = (wanted + ParticlePoolChunk - 1) / ParticlePoolChunk * ParticlePoolChunk;
+		Reallocate(grown < limit ? grown : limit);
+		return n <= capacity;
+	}
+
+	// Call after Compact(), about once per frame. Gives back the chunks the live
+	// particles left once the pool stayed under half full (and two chunks
+	// free) for TrimDelay calls, keeping a quarter of the live count spare.
+	// Particles dying and spawning every frame never resize it.
+	void Trim() {
+		if (count > capacity / 2 || capacity - count < 2 * ParticlePoolChunk) {
+			underused = 0;
+			return;
+		}
+		if (++underused < TrimDelay) {
+			return;
+		}
+		underused = 0;
+		int wanted = count + count / 4 + ParticlePoolChunk;
+		Reallocate((wanted + ParticlePoolChunk - 1) / ParticlePoolChunk * ParticlePoolChunk);
+	}
+
+	glm::vec3 Position(int i) const {
+		return glm::vec3(posX[i], posY[i], posZ[i]);
+	}
+
+	void SetPosition(int i, const glm::vec3& p) {
+		posX[i] = p.x;
+		posY[i] = p.y;
+		posZ[i] = p.z;
+	}
+
+	void SetSpeed(int i, const glm::vec3& s) {
+		speedX[i] = s.x;
+		speedY[i] = s.y;
+		speedZ[i] = s.z;
+	}
+
+	void SetColor(int i, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+		color[4 * i + 0] = r;
+		color[4 * i + 1] = g;
+		color[4 * i + 2] = b;
+		color[4 * i + 3] = a;
+	}
+
+	// FNV-1a hash of the live particles, to check that two runs match bit for bit
+	unsigned int Checksum(unsigned int hash = 2166136261u) const {
+		const float* fields[] = { posX, posY, posZ, speedX, speedY, speedZ, life, size };
+		for (int f = 0; f < 8; f++) {
+			const unsigned char* bytes = (const unsigned char*)fields[f];
+			for (size_t i = 0; i < count * sizeof(float); i++) {
+				hash = (hash ^ bytes[i]) * 16777619u;
+			}
+		}
+		return (hash ^ (unsigned int)count) * 16777619u;
+	}
+
+	// Return the particles that died this frame (cameradistance = -1) to the
+	// free stack. Each hole is filled with the last live particle, so only as
+	// many particles move as died below the new count, and the pool order is
+	// not kept. When remap is given, remap[old index] receives the new index,
+	// or -1.
+	void Compact(int* remap = NULL) {
+		int end = count;
+		int i = 0;
+		while (i < end) {
+			if (cameradistance[i] >= 0.0f) {
+				if (remap) {
+					remap[i] = i;
+				}
+				i++;
+				continue;
+			}
+			if (remap) {
+				remap[i] = -1;
+			}
+			// Dead particles at the end only shrink the live range
+			end--;
+			while (end > i && cameradistance[end] < 0.0f) {
+				if (remap) {
+					remap[end] = -1;
+				}
+				end--;
+			}
+			if (end > i) {
+				Move(end, i);
+				if (remap) {
+					remap[end] = i;
+				}
+				i++;
+			}
+		}
+		count = end;
+	}
+
+private:
+	int underused;
+	// Every array, one after the other, each aligned to 32 bytes
+	unsigned char* storage;
+
+	ParticlePool(const ParticlePool&);
+	ParticlePool& operator=(const ParticlePool&);
+
+	void Reallocate(int newCapacity) {
+		// Every field takes 4 bytes per particle
+		size_t bytes = ((size_t)newCapacity * 4 + 31) & ~(size_t)31;
+		unsigned char* newStorage = (unsigned char*)malloc(Fields * bytes + 32);
+		unsigned char* at = (unsigned char*)(((uintptr_t)newStorage + 31) & ~(uintptr_t)31);
+		unsigned char* arrays[Fields] = {
+			(unsigned char*)posX, (unsigned char*)posY, (unsigned char*)posZ,
+			(unsigned char*)speedX, (unsigned char*)speedY, (unsigned char*)speedZ,
+			(unsigned char*)life, (unsigned char*)size, (unsigned char*)cameradistance,
+			color, (unsigned char*)angle, (unsigned char*)weight };
+		for (int f = 0; f < Fields; f++) {
+			if (count > 0) {
+				memcpy(at + f * bytes, arrays[f], (size_t)count * 4);
+			}
+			arrays[f] = at + f * bytes;
+		}
+		posX = (float*)arrays[0];
+		posY = (float*)arrays[1];
+		posZ = (float*)arrays[2];
+		speedX = (float*)arrays[3];
+		speedY = (float*)arrays[4];
+		speedZ = (float*)arrays[5];
+		life = (float*)arrays[6];
+		size = (float*)arrays[7];
+		cameradistance = (float*)arrays[8];
+		color = arrays[9];
+		angle = (float*)arrays[10];
+		weight = (float*)arrays[11];
+		free(storage);
+		storage = newStorage;
+		// New slots start dead
+		for (int i = count; i < newCapacity; i++) {
+			life[i] = -1.0f;
+			cameradistance[i] = -1.0f;
+		}
+		capacity = newCapacity;
+	}
+
+	void Move(int from, int to) {
+		posX[to] = posX[from];
+		posY[to] = posY[from];
+		posZ[to] = posZ[from];
+		speedX[to] = speedX[from];
+		speedY[to] = speedY[from];
+		speedZ[to] = speedZ[from];
+		life[to] = life[from];
+		size[to] = size[from];
+		cameradistance[to] = cameradistance[from];
+		memcpy(&color[4 * to], &color[4 * from], 4);
+		angle[to] = angle[from];
+		weight[to] = weight[from];
+	}
+};
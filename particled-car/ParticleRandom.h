@@ -0,0 +1,133 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include "ParticleKernel.h"
+
+// Counter based random numbers for particle emission.
+// The n-th number of a generator is a hash of (key, n), so there is no state
+// to carry from one number to the next : a whole burst is filled with SIMD,
+// and any range of a sequence can be computed on any thread with the same
+// result. The key comes from a seed and a stream number, one stream per
+// particle system, so systems never share a sequence.
+// All versions compute exactly the same values, so a seed gives the same run
+// whatever the CPU.
+
+const unsigned int RandomGolden = 0x9E3779B9u;
+
+// Integer finalizer with low bias (Chris Wellons' lowbias32)
+inline unsigned int RandomHash(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x7FEB352Du;
+	x ^= x >> 15;
+	x *= 0x846CA68Bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// Fill out[0, n) with uniform floats between lo and hi from numbers counter, counter + 1, ...
+typedef void (*RandomFill)(unsigned int key, unsigned int counter, float* out, int n, float lo, float hi);
+
+inline void FillRandomScalar(unsigned int key, unsigned int counter, float* out, int n, float lo, float hi) {
+	float scale = (hi - lo) * (1.0f / 16777216.0f);
+	for (int i = 0; i < n; i++) {
+		unsigned int bits = RandomHash(key + (counter + i) * RandomGolden);
+		out[i] = lo + (float)(int)(bits >> 8) * scale;
+	}
+}
+
+// SSE4.2 version, 4 numbers per iteration
+PARTICLE_TARGET_SSE42
+inline void FillRandomSSE(unsigned int key, unsigned int counter, float* out, int n, float lo, float hi) {
+	float scale = (hi - lo) * (1.0f / 16777216.0f);
+	const __m128i golden = _mm_set1_epi32((int)RandomGolden);
+	const __m128i keys = _mm_set1_epi32((int)key);
+	const __m128i m1 = _mm_set1_epi32(0x7FEB352D);
+	const __m128i m2 = _mm_set1_epi32((int)0x846CA68Bu);
+	const __m128 lows = _mm_set1_ps(lo);
+	const __m128 scales = _mm_set1_ps(scale);
+	__m128i counters = _mm_add_epi32(_mm_set1_epi32((int)counter), _mm_setr_epi32(0, 1, 2, 3));
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_add_epi32(keys, _mm_mullo_epi32(counters, golden));
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		x = _mm_mullo_epi32(x, m1);
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+		x = _mm_mullo_epi32(x, m2);
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		__m128 unit = _mm_cvtepi32_ps(_mm_srli_epi32(x, 8));
+		_mm_storeu_ps(&out[i], _mm_add_ps(lows, _mm_mul_ps(unit, scales)));
+		counters = _mm_add_epi32(counters, _mm_set1_epi32(4));
+	}
+	FillRandomScalar(key, counter + i, &out[i], n - i, lo, hi);
+}
+
+// AVX2 version, 8 numbers per iteration
+PARTICLE_TARGET_AVX2
+inline void FillRandomAVX2(unsigned int key, unsigned int counter, float* out, int n, float lo, float hi) {
+	float scale = (hi - lo) * (1.0f / 16777216.0f);
+	const __m256i golden = _mm256_set1_epi32((int)RandomGolden);
+	const __m256i keys = _mm256_set1_epi32((int)key);
+	const __m256i m1 = _mm256_set1_epi32(0x7FEB352D);
+	const __m256i m2 = _mm256_set1_epi32((int)0x846CA68Bu);
+	const __m256 lows = _mm256_set1_ps(lo);
+	const __m256 scales = _mm256_set1_ps(scale);
+	__m256i counters = _mm256_add_epi32(_mm256_set1_epi32((int)counter), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_add_epi32(keys, _mm256_mullo_epi32(counters, golden));
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+		x = _mm256_mullo_epi32(x, m1);
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+		x = _mm256_mullo_epi32(x, m2);
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+		__m256 unit = _mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8));
+		_mm256_storeu_ps(&out[i], _mm256_add_ps(lows, _mm256_mul_ps(unit, scales)));
+		counters = _mm256_add_epi32(counters, _mm256_set1_epi32(8));
+	}
+	FillRandomScalar(key, counter + i, &out[i], n - i, lo, hi);
+}
+
+// Pick the widest fill the CPU and OS support
+inline RandomFill SelectRandomFill() {
+	switch (DetectParticleSimd()) {
+	case ParticleSimdAVX2:
+		return FillRandomAVX2;
+	case ParticleSimdSSE42:
+		return FillRandomSSE;
+	default:
+		return FillRandomScalar;
+	}
+}
+
+// Fill in use, selected on first call
+inline RandomFill SelectedRandomFill() {
+	static const RandomFill fill = SelectRandomFill();
+	return fill;
+}
+
+class ParticleRandom {
+public:
+	explicit ParticleRandom(unsigned int seed = 0, unsigned int stream = 0) {
+		Seed(seed, stream);
+	}
+
+	void Seed(unsigned int seed, unsigned int stream) {
+		key = RandomHash(seed ^ RandomHash(stream * RandomGolden + 1));
+		counter = 0;
+	}
+
+	unsigned int Next() {
+		return RandomHash(key + counter++ * RandomGolden);
+	}
+
+	// Fill out[0, n) with uniform floats between lo and hi
+	void Fill(float* out, int n, float lo, float hi) {
+		SelectedRandomFill()(key, counter, out, n, lo, hi);
+		counter += n;
+	}
+
+private:
+	unsigned int key;
+	unsigned int counter;
+};
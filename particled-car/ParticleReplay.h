@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+// Record/replay log of the inputs of the fixed timestep particle simulation.
+// With a fixed step, the seed of the random streams, the strength of the
+// turbulent wind field, the splash budget, the particle limit and the wind
+// of every step are all the simulation depends on, so replaying them gives the same
+// particles bit for bit, on any machine and whatever the frame rate.
+// Layout : a ParticleLogHeader, then one float per step, the wind strength.
+// The header is written again on Close() with the step count and the checksum
+// of the particles after the last step, which the replay compares against.
+struct ParticleLogHeader {
+	char magic[4];
+	unsigned int version;
+	unsigned int seed;
+	float step;
+	// Amplitude of the turbulent wind field, see WindField
+	float turbulence;
+	// Splashes per step at most, see SplashBudget
+	int splashBudget;
+	// Live particles per pool at most, see ParticlePool::limit
+	int particleLimit;
+	unsigned int steps;
+	unsigned int checksum;
+};
+
+class ParticleLog {
+public:
+	ParticleLogHeader header;
+	// Steps recorded or replayed so far
+	unsigned int steps;
+
+	ParticleLog() : steps(0), file(NULL), recording(false) {
+		memset(&header, 0, sizeof(header));
+	}
+
+	bool Recording() const {
+		return file != NULL && recording;
+	}
+
+	bool Replaying() const {
+		return file != NULL && !recording;
+	}
+
+	bool OpenRecord(const char* path, unsigned int seed, float step, float turbulence, int splashBudget, int particleLimit) {
+		file = fopen(path, "wb");
+		if (file == NULL) {
+			fprintf(stderr, "Impossible to open %s for recording\n", path);
+			return false;
+		}
+		recording = true;
+		memcpy(header.magic, "PLOG", 4);
+		// 3 : pools compact by swap-remove, which changes the checksum of a run
+		// 4 : the splash budget
+		// 5 : the particle limit
+		header.version = 5;
+		header.seed = seed;
+		header.step = step;
+		header.turbulence = turbulence;
+		header.splashBudget = splashBudget;
+		header.particleLimit = particleLimit;
+		fwrite(&header, sizeof(header), 1, file);
+		return true;
+	}
+
+	bool OpenReplay(const char* path) {
+		file = fopen(path, "rb");
+		if (file == NULL) {
+			fprintf(stderr, "Impossible to open %s for replay\n", path);
+			return false;
+		}
+		recording = false;
+		if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "PLOG", 4) != 0 || header.version != 5) {
+			fprintf(stderr, "%s is not a particle log\n", path);
+			fclose(file);
+			file = NULL;
+			return false;
+		}
+		return true;
+	}
+
+	void RecordStep(float wind) {
+		fwrite(&wind, sizeof(wind), 1, file);
+		steps++;
+	}
+
+	// Read the wind of the next step. Returns false once every step was replayed.
+	bool ReplayStep(float& wind) {
+		if (steps >= header.steps || fread(&wind, sizeof(wind), 1, file) != 1) {
+			return false;
+		}
+		steps++;
+		return true;
+	}
+
+	// Finish the log. checksum is the particle checksum after the last step.
+	void Close(unsigned int checksum) {
+		if (file == NULL) {
+			return;
+		}
+		if (recording) {
+			header.steps = steps;
+			header.checksum = checksum;
+			fseek(file, 0, SEEK_SET);
+			fwrite(&header, sizeof(header), 1, file);
+		}
+		fclose(file);
+		file = NULL;
+	}
+
+private:
+	FILE* file;
+	bool recording;
+};
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtx/norm.hpp>
+
+#include "ParticlePool.h"
+
+// Depth sort of live particles.
+// Only particles with cameradistance >= 0 take part. Their distances are
+// turned into 32 bit keys that order as unsigned integers, and (key, index)
+// pairs are sorted with an LSD radix sort, 8 bits per pass. The particles
+// themselves never move; the result is the list of particle indices, far
+// particles first.
+//
+// In incremental mode the order of the previous frame is kept. Distances
+// barely change from one frame to the next, so that order only needs a short
+// insertion pass to be correct again; the particles spawned since then are
+// radix sorted on their own and merged in. A full sort is done instead when
+// the camera moved more than cameraThreshold, or when the repair would take
+// more than repairBudget element moves per particle.
+//
+// An optional visible mask (one byte per particle, from frustum culling)
+// leaves out the particles it marks 0. The order then misses particles that
+// may come back into view, so the next repair scans the whole pool for live
+// visible particles it does not hold yet, instead of the new ones only.
+class ParticleSorter {
+public:
+	bool incremental;
+	float cameraThreshold;
+	int repairBudget;
+	// Number of frames sorted by repairing the previous order, and from scratch
+	int repairs;
+	int fullSorts;
+
+	ParticleSorter() : incremental(true), cameraThreshold(0.05f), repairBudget(4), repairs(0), fullSorts(0), sortedCount(0), previousCount(0), previousValid(false), previousComplete(true) {
+	}
+
+	// Sorted particle indices, valid after Sort()
+	const int* Order() const {
+		return order.data();
+	}
+
+	// Sort the live (and visible) particles of pool back to front. Returns
+	// how many there are.
+	int Sort(const ParticlePool& pool, const glm::vec3& camera, const unsigned char* visible = NULL) {
+		Fit(pool);
+		bool coherent = incremental && previousValid && glm::length2(camera - previousCamera) <= cameraThreshold * cameraThreshold;
+		previousCamera = camera;
+		int n = coherent ? Repair(pool, visible) : -1;
+		if (n >= 0) {
+			repairs++;
+		}
+		else {
+			fullSorts++;
+			n = FullSort(pool, visible);
+		}
+		previousCount = pool.count;
+		previousComplete = visible == NULL;
+		unsorted.clear();
+		return n;
+	}
+
+	// List the live (and visible) particles of pool in pool order, for
+	// blending that does not depend on draw order. Compact() works the same
+	// after it.
+	int CollectUnsorted(const ParticlePool& pool, const unsigned char* visible = NULL) {
+		Fit(pool);
+		sortedCount = CollectLive(pool, 0, pool.count, 0, visible);
+		previousCount = pool.count;
+		previousComplete = visible == NULL;
+		unsorted.clear();
+		return sortedCount;
+	}
+
+	// Nothing of pool is drawn this frame. The order is kept for Compact()
+	// and the next repair, which looks for the particles it misses.
+	void Skip() {
+		previousComplete = false;
+	}
+
+	// Drop the dead particles from pool and move the stored order along, so
+	// the next frame can start from it. It may be called several times
+	// between two sorts : sorted particles that died since are dropped from
+	// the order, and the survivors keep their place in it under their new
+	// index. Compaction fills holes with the last particles of the pool, so
+	// particles spawned since the sort may land among the ones the order
+	// holds : they are kept in unsorted for the next repair.
+	void Compact(ParticlePool& pool) {
+		Fit(pool);
+		int count = pool.count;
+		pool.Compact(remap.data());
+		int kept = 0;
+		for (int i = 0; i < sortedCount; i++) {
+			int index = remap[order[i]];
+			if (index >= 0) {
+				order[kept++] = index;
+			}
+		}
+		// Every live particle the order does not hold, at its new index
+		int missing = 0;
+		for (size_t i = 0; i < unsorted.size(); i++) {
+			int index = remap[unsorted[i]];
+			if (index >= 0) {
+				unsorted[missing++] = index;
+			}
+		}
+		unsorted.resize(missing);
+		for (int i = previousCount; i < count; i++) {
+			if (remap[i] >= 0) {
+				unsorted.push_back(remap[i]);
+			}
+		}
+		sortedCount = kept;
+		previousCount = pool.count;
+		previousValid = true;
+	}
+
+	// Flip a float so larger values give smaller unsigned keys: ascending key
+	// order is then back to front. Negative floats are handled too, even
+	// though live distances never are.
+	static unsigned int FlipKey(float value) {
+		unsigned int bits;
+		memcpy(&bits, &value, sizeof(bits));
+		unsigned int mask = (bits & 0x80000000u) ? 0xFFFFFFFFu : 0x80000000u;
+		return ~(bits ^ mask);
+	}
+
+private:
+	// Per particle arrays, as large as the pool capacity
+	std::vector<unsigned int> keys;
+	std::vector<unsigned int> keyScratch;
+	std::vector<int> order;
+	std::vector<int> orderScratch;
+	std::vector<int> remap;
+	int sortedCount;
+	// Pool size after the last sort or compaction; particles at or above it are new
+	int previousCount;
+	bool previousValid;
+	// The order holds every live particle below previousCount but unsorted
+	bool previousComplete;
+	// Particles below previousCount that the order does not hold : spawned
+	// after the sort, then moved by compaction
+	std::vector<int> unsorted;
+	// Scratch flags of the particles held by the order, for Repair()
+	std::vector<unsigned char> held;
+	glm::vec3 previousCamera;
+
+	// Follow the pool when it grew or was trimmed
+	void Fit(const ParticlePool& pool) {
+		if ((int)keys.size() == pool.capacity) {
+			return;
+		}
+		FitParticleArray(keys, pool.capacity);
+		FitParticleArray(keyScratch, pool.capacity);
+		FitParticleArray(order, pool.capacity);
+		FitParticleArray(orderScratch, pool.capacity);
+		FitParticleArray(remap, pool.capacity);
+		FitParticleArray(held, pool.capacity);
+	}
+
+	int FullSort(const ParticlePool& pool, const unsigned char* visible) {
+		int n = CollectLive(pool, 0, pool.count, 0, visible);
+		RadixSort(0, n);
+		sortedCount = n;
+		return n;
+	}
+
+	// Returns the number of sorted particles, or -1 when the previous order
+	// was too far off and a full sort is needed.
+	int Repair(const ParticlePool& pool, const unsigned char* visible) {
+		// Previous order, minus the particles that died (or left the view) this frame
+		int old = 0;
+		for (int i = 0; i < sortedCount; i++) {
+			int index = order[i];
+			float distance = pool.cameradistance[index];
+			if (distance >= 0.0f && (visible == NULL || visible[index])) {
+				keys[old] = FlipKey(distance);
+				order[old] = index;
+				old++;
+			}
+		}
+		if (!InsertionSort(old, repairBudget * old)) {
+			return -1;
+		}
+		int n;
+		if (visible == NULL && previousComplete) {
+			// Particles spawned since the last frame
+			n = CollectLive(pool, previousCount, pool.count, old, NULL);
+			for (size_t i = 0; i < unsorted.size(); i++) {
+				n = CollectLive(pool, unsorted[i], unsorted[i] + 1, n, NULL);
+			}
+		}
+		else {
+			// Also the particles culled last frame and visible now
+			memset(held.data(), 0, pool.count);
+			for (int i = 0; i < old; i++) {
+				held[order[i]] = 1;
+			}
+			n = old;
+			for (int i = 0; i < pool.count; i++) {
+				if (!held[i] && pool.cameradistance[i] >= 0.0f && (visible == NULL || visible[i])) {
+					keys[n] = FlipKey(pool.cameradistance[i]);
+					order[n] = i;
+					n++;
+				}
+			}
+		}
+		RadixSort(old, n - old);
+		Merge(old, n);
+		sortedCount = n;
+		return n;
+	}
+
+	// Append (key, index) of the live (and visible) particles in [begin, end)
+	// at position at
+	int CollectLive(const ParticlePool& pool, int begin, int end, int at, const unsigned char* visible) {
+		for (int i = begin; i < end; i++) {
+			float distance = pool.cameradistance[i];
+			if (distance >= 0.0f && (visible == NULL || visible[i])) {
+				keys[at] = FlipKey(distance);
+				order[at] = i;
+				at++;
+			}
+		}
+		return at;
+	}
+
+	// Insertion sort of [0, n) that gives up after budget element moves.
+	// The pairs are left as a valid permutation when it does.
+	bool InsertionSort(int n, int budget) {
+		int moves = 0;
+		for (int i = 1; i < n; i++) {
+			unsigned int key = keys[i];
+			int index = order[i];
+			int j = i - 1;
+			bool exhausted = false;
+			while (j >= 0 && keys[j] > key) {
+				if (moves++ >= budget) {
+					exhausted = true;
+					break;
+				}
+				keys[j + 1] = keys[j];
+				order[j + 1] = order[j];
+				j--;
+			}
+			keys[j + 1] = key;
+			order[j + 1] = index;
+			if (exhausted) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Radix sort the n pairs starting at first
+	void RadixSort(int first, int n) {
+		unsigned int* keyIn = keys.data() + first;
+		unsigned int* keyOut = keyScratch.data() + first;
+		int* indexIn = order.data() + first;
+		int* indexOut = orderScratch.data() + first;
+		// One read of the keys builds the histograms of all four passes
+		unsigned int histogram[4][256];
+		memset(histogram, 0, sizeof(histogram));
+		for (int i = 0; i < n; i++) {
+			unsigned int key = keyIn[i];
+			histogram[0][key & 0xFF]++;
+			histogram[1][(key >> 8) & 0xFF]++;
+			histogram[2][(key >> 16) & 0xFF]++;
+			histogram[3][key >> 24]++;
+		}
+		for (int pass = 0; pass < 4; pass++) {
+			int shift = pass * 8;
+			// Skip the pass when every key has the same digit
+			if (n == 0 || histogram[pass][(keyIn[0] >> shift) & 0xFF] == (unsigned int)n) {
+				continue;
+			}
+			unsigned int offset = 0;
+			for (int digit = 0; digit < 256; digit++) {
+				unsigned int c = histogram[pass][digit];
+				histogram[pass][digit] = offset;
+				offset += c;
+			}
+			for (int i = 0; i < n; i++) {
+				unsigned int key = keyIn[i];
+				unsigned int slot = histogram[pass][(key >> shift) & 0xFF]++;
+				keyOut[slot] = key;
+				indexOut[slot] = indexIn[i];
+			}
+			std::swap(keyIn, keyOut);
+			std::swap(indexIn, indexOut);
+		}
+		if (indexIn != order.data() + first) {
+			memcpy(keys.data() + first, keyIn, n * sizeof(unsigned int));
+			memcpy(order.data() + first, indexIn, n * sizeof(int));
+		}
+	}
+
+	// Merge the sorted runs [0, middle) and [middle, n)
+	void Merge(int middle, int n) {
+		if (middle == 0 || middle == n) {
+			return;
+		}
+		int a = 0, b = middle, out = 0;
+		while (a < middle && b < n) {
+			bool takeA = keys[a] <= keys[b];
+			int from = takeA ? a++ : b++;
+			keyScratch[out] = keys[from];
+			orderScratch[out] = order[from];
+			out++;
+		}
+		for (; a < middle; a++, out++) {
+			keyScratch[out] = keys[a];
+			orderScratch[out] = order[a];
+		}
+		for (; b < n; b++, out++) {
+			keyScratch[out] = keys[b];
+			orderScratch[out] = order[b];
+		}
+		memcpy(keys.data(), keyScratch.data(), n * sizeof(unsigned int));
+		memcpy(order.data(), orderScratch.data(), n * sizeof(int));
+	}
+};
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtx/norm.hpp>
+
+#include "ParticlePool.h"
+#include "ParticleKernel.h"
+#include "ParticleSort.h"
+#include "ParticleCull.h"
+#include "ParticleInstance.h"
+#include "ParticleRandom.h"
+#include "CarSDF.h"
+#include "WindField.h"
+
+// One particle effect : pool, staging records, depth sorter and random
+// stream, with what differs between effects given as policies resolved at
+// compile time. The instances of every effect are gathered into one shared
+// stream buffer, see GatherMergedParticles.
+//
+// EmitterPolicy : where and how particles spawn, static functions
+//   Life(), Color(unsigned char[4]), MinSize(), MaxSize(), and for burst
+//   emitters Origin(), Direction(wind), Spread().
+// PhysicsPolicy : static Gravity(), and WindResponse(), how much of the
+//   turbulent wind field the particles take (0 : none).
+// CollisionPolicy : static Enabled, and static Collide(...) to answer a hit
+//   found by sweeping the particle move through the car distance field.
+//
+// Each instantiation gets its own chunk update, so the hot loop has no
+// virtual call and no per particle test of the system type.
+
+// Collision radius of the particles against the car
+const float ParticleCollisionRadius = 0.01f;
+
+// A range of one system, simulated by one thread. simulate is the update of
+// the system type, so a list of chunks can mix systems.
+struct ParticleChunk {
+	void (*simulate)(ParticleChunk& chunk, float delta);
+	void* system;
+	int begin, end;
+	glm::vec3 camera;
+	// Contacts recorded by SplashCollision
+	std::vector<glm::vec3> hits;
+};
+
+// Gravity along y, blown by the wind
+struct FallingPhysics {
+	static float Gravity() {
+		return -9.81f;
+	}
+	static float WindResponse() {
+		return 1.0f;
+	}
+};
+
+// No forces
+struct StillPhysics {
+	static float Gravity() {
+		return 0.0f;
+	}
+	static float WindResponse() {
+		return 0.0f;
+	}
+};
+
+// Fly through the car
+struct NoCollision {
+	static const bool Enabled = false;
+	static void Collide(ParticlePool&, int, const CarSDF&, const glm::vec3&, const glm::vec3&, float, glm::vec3&, std::vector<glm::vec3>&) {
+	}
+};
+
+// Die at the contact, which is recorded in the chunk hits (rain)
+struct SplashCollision {
+	static const bool Enabled = true;
+	static void Collide(ParticlePool& pool, int i, const CarSDF&, const glm::vec3& contact, const glm::vec3&, float, glm::vec3&, std::vector<glm::vec3>& hits) {
+		hits.push_back(contact);
+		pool.life[i] = 0.0f;
+		pool.cameradistance[i] = -1.0f;
+	}
+};
+
+// Keep the tangential speed only and slide for the rest of the step, pushed
+// back out if that went into a curved part (smoke)
+struct SlideCollision {
+	static const bool Enabled = true;
+	static void Collide(ParticlePool& pool, int i, const CarSDF& collider, const glm::vec3& contact, const glm::vec3& normal, float remaining, glm::vec3& position, std::vector<glm::vec3>&) {
+		glm::vec3 speed(pool.speedX[i], pool.speedY[i], pool.speedZ[i]);
+		glm::vec3 slide = speed - normal * glm::dot(speed, normal);
+		position = contact + slide * remaining;
+		float depth = ParticleCollisionRadius - collider.Distance(position);
+		if (depth > 0.0f) {
+			position += normal * depth;
+		}
+		pool.SetSpeed(i, slide);
+		pool.SetPosition(i, position);
+	}
+};
+
+template <class EmitterPolicy, class PhysicsPolicy, class CollisionPolicy>
+class ParticleSystem {
+public:
+	// Particles per chunk of the thread pool
+	static const int ChunkSize = 2048;
+
+	ParticlePool pool;
+	ParticleSorter sorter;
+	ParticleRandom random;
+	// Kernel output in particle order, the sorted copy goes to the stream
+	// buffer. 4 floats per particle of the pool capacity.
+	std::vector<float> staging;
+	// Bounding radius of the particle quad at size 1, for frustum culling
+	float quadRadius;
+	// Shape and atlas layer of the particles, see ParticleInstance
+	unsigned int material;
+	// Particles left out by frustum culling (dead ones included), and frames
+	// the whole system was off screen, since the counters were last reset
+	int culled;
+	int offscreenFrames;
+	// Live particles at the last spawn before the budget started throttling,
+	// see ParticleBudget::Spawns
+	int spawnBase;
+
+	ParticleSystem() : quadRadius(1.0f), material(0), culled(0), offscreenFrames(0), spawnBase(0), kernel(SimulateParticlesScalar), culler(CullParticlesScalar), collider(NULL), wind(NULL) {
+	}
+
+	// seed and streamId pick the random stream, see ParticleRandom. field is
+	// the turbulent wind, or NULL for none.
+	void Init(unsigned int seed, unsigned int streamId, ParticleKernel simulate, ParticleCuller cull, const CarSDF* car, const WindField* field) {
+		random.Seed(seed, streamId);
+		kernel = simulate;
+		culler = cull;
+		collider = car;
+		wind = field;
+	}
+
+	// Spawn count particles from the emitter, in the given wind. Sizes are
+	// scaled by sizeScale. The random values of the whole burst are drawn
+	// even for spawns the pool drops.
+	void Emit(int count, float wind, float sizeScale) {
+		for (int k = 0; k < 4; k++) {
+			if ((int)burst[k].size() < count) {
+				burst[k].resize(count);
+			}
+		}
+		random.Fill(burst[0].data(), count, -1.0f, 1.0f);
+		random.Fill(burst[1].data(), count, -1.0f, 1.0f);
+		random.Fill(burst[2].data(), count, -1.0f, 1.0f);
+		random.Fill(burst[3].data(), count, EmitterPolicy::MinSize(), EmitterPolicy::MaxSize());
+		unsigned char color[4];
+		EmitterPolicy::Color(color);
+		glm::vec3 origin = EmitterPolicy::Origin();
+		glm::vec3 direction = EmitterPolicy::Direction(wind);
+		float spread = EmitterPolicy::Spread();
+		for (int i = 0; i < count; i++) {
+			int index = pool.Allocate();
+			if (index < 0) {
+				// Pool is full, the spawn is counted in dropped
+				continue;
+			}
+			pool.life[index] = EmitterPolicy::Life();
+			pool.SetPosition(index, origin);
+			// Random direction
+			pool.SetSpeed(index, direction + glm::vec3(burst[0][i], burst[1][i], burst[2][i]) * spread);
+			pool.SetColor(index, color[0], color[1], color[2], color[3]);
+			pool.size[index] = burst[3][i] * sizeScale;
+		}
+		Fit();
+	}
+
+	// Spawn one still particle at each of the n points, as one block of the
+	// pool. Every field is filled as a whole array, and the sizes come from
+	// one random fill.
+	void EmitAt(const glm::vec3* points, int n) {
+		int first = pool.AllocateBlock(n);
+		for (int i = 0; i < n; i++) {
+			pool.posX[first + i] = points[i].x;
+			pool.posY[first + i] = points[i].y;
+			pool.posZ[first + i] = points[i].z;
+		}
+		std::fill(&pool.speedX[first], &pool.speedX[first + n], 0.0f);
+		std::fill(&pool.speedY[first], &pool.speedY[first + n], 0.0f);
+		std::fill(&pool.speedZ[first], &pool.speedZ[first + n], 0.0f);
+		std::fill(&pool.life[first], &pool.life[first + n], EmitterPolicy::Life());
+		unsigned char color[4];
+		EmitterPolicy::Color(color);
+		for (int i = 0; i < n; i++) {
+			memcpy(&pool.color[4 * (first + i)], color, 4);
+		}
+		random.Fill(&pool.size[first], n, EmitterPolicy::MinSize(), EmitterPolicy::MaxSize());
+		Fit();
+	}
+
+	// Cut the pool into chunks and append them to chunks, starting at first.
+	// Returns the new chunk count.
+	int AddChunks(std::vector<ParticleChunk>& chunks, int first, const glm::vec3& camera) {
+		for (int begin = 0; begin < pool.count; begin += ChunkSize) {
+			if (first >= (int)chunks.size()) {
+				chunks.resize(first + 1);
+			}
+			ParticleChunk& c = chunks[first++];
+			c.simulate = SimulateChunk;
+			c.system = this;
+			c.begin = begin;
+			c.end = std::min(begin + ChunkSize, pool.count);
+			c.camera = camera;
+			c.hits.clear();
+		}
+		return first;
+	}
+
+	// Simulate [begin, end) on this thread, for particles spawned after the chunks ran
+	void Simulate(int begin, int end, float delta, const glm::vec3& camera) {
+		ParticleChunk c;
+		c.system = this;
+		c.begin = begin;
+		c.end = end;
+		c.camera = camera;
+		SimulateChunk(c, delta);
+	}
+
+	// Fixed step : recompute the staging records and camera distances of the
+	// live particles back seconds before the last step
+	void StageInterpolated(float back, const glm::vec3& camera) {
+		StageInterpolatedParticles(pool, 0, pool.count, back, camera, staging.data());
+	}
+
+	// Order the live particles back to front (or keep pool order for order
+	// independent blending). Returns how many are drawn, VisibleRun() hands
+	// them to the gather, then Compact() drops the dead particles.
+	// With a frustum, only the particles in view are sorted. The box around
+	// the whole system is tested first : off screen, nothing is sorted at all;
+	// fully in view, the particles need no test of their own.
+	int SortVisible(const glm::vec3& camera, bool sorted, const ParticleFrustum* frustum = NULL) {
+		const unsigned char* mask = NULL;
+		if (frustum != NULL && pool.count > 0) {
+			glm::vec3 lo, hi;
+			ParticleBounds(staging.data(), pool.count, quadRadius, lo, hi);
+			ParticleFrustum::Result bounds = frustum->TestBox(lo, hi);
+			if (bounds == ParticleFrustum::Outside) {
+				culled += pool.count;
+				offscreenFrames++;
+				sorter.Skip();
+				return 0;
+			}
+			if (bounds == ParticleFrustum::Intersecting) {
+				culled += pool.count - culler(staging.data(), pool.cameradistance, 0, pool.count, *frustum, quadRadius, visible.data());
+				mask = visible.data();
+			}
+		}
+		return sorted ? sorter.Sort(pool, camera, mask) : sorter.CollectUnsorted(pool, mask);
+	}
+
+	// The n particles SortVisible() returned, valid until Compact()
+	ParticleRun VisibleRun(int n) const {
+		ParticleRun run;
+		run.order = sorter.Order();
+		run.n = n;
+		run.cameradistance = pool.cameradistance;
+		run.position = staging.data();
+		run.color = pool.color;
+		run.material = material;
+		return run;
+	}
+
+	// Drop the dead particles, keeping the sort order. With trim, also give
+	// back the chunks they leave free : Trim() counts calls as frames, so only
+	// one compaction per frame may trim.
+	void Compact(bool trim) {
+		sorter.Compact(pool);
+		if (trim) {
+			pool.Trim();
+			Fit();
+		}
+	}
+
+private:
+	ParticleKernel kernel;
+	ParticleCuller culler;
+	const CarSDF* collider;
+	const WindField* wind;
+	// Frustum test result per particle, see ParticleCuller
+	std::vector<unsigned char> visible;
+	// Random directions and sizes of one emission burst
+	std::vector<float> burst[4];
+
+	// Follow the pool capacity with the per particle arrays
+	void Fit() {
+		if ((int)visible.size() != pool.capacity) {
+			FitParticleArray(staging, pool.capacity * 4);
+			FitParticleArray(visible, pool.capacity);
+		}
+	}
+
+	static void SimulateChunk(ParticleChunk& c, float delta) {
+		ParticleSystem& system = *(ParticleSystem*)c.system;
+		ParticlePool& pool = system.pool;
+		// Wind first, on the chunk the kernel reads next while it is in cache
+		if (PhysicsPolicy::WindResponse() != 0.0f && system.wind != NULL) {
+			system.wind->Apply(pool, c.begin, c.end, delta, PhysicsPolicy::WindResponse());
+		}
+		system.kernel(pool, c.begin, c.end, delta, PhysicsPolicy::Gravity(), c.camera, system.staging.data());
+		if (!CollisionPolicy::Enabled) {
+			return;
+		}
+		// Collision : sweep the move of this step through the car distance
+		// field. The kernel already moved the particle, where it came from is
+		// one step of its speed back.
+		const CarSDF& collider = *system.collider;
+		for (int i = c.begin; i < c.end; i++) {
+			// Particles that just died have cameradistance = -1
+			if (pool.cameradistance[i] < 0.0f) {
+				continue;
+			}
+			glm::vec3 to = pool.Position(i);
+			glm::vec3 from = to - glm::vec3(pool.speedX[i], pool.speedY[i], pool.speedZ[i]) * delta;
+			float fraction;
+			glm::vec3 normal;
+			if (!collider.Sweep(from, to, ParticleCollisionRadius, fraction, normal)) {
+				continue;
+			}
+			glm::vec3 contact = from + (to - from) * fraction;
+			glm::vec3 position;
+			CollisionPolicy::Collide(pool, i, collider, contact, normal, delta * (1.0f - fraction), position, c.hits);
+			if (pool.cameradistance[i] >= 0.0f) {
+				pool.cameradistance[i] = glm::length2(position - c.camera);
+				system.staging[4 * i + 0] = position.x;
+				system.staging[4 * i + 1] = position.y;
+				system.staging[4 * i + 2] = position.z;
+			}
+		}
+	}
+};
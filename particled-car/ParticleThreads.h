@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small fork/join thread pool for the particle simulation.
+// Run() hands out task indices to the workers and to the calling thread, and
+// returns once every task is finished. Each task is executed by exactly one
+// thread, so per task output buffers need no locking.
+class ParticleThreadPool {
+public:
+	// workers = 0 picks one worker per hardware thread, minus the caller
+	explicit ParticleThreadPool(int workers = 0) : job(NULL), tasks(0), next(0), busy(0), generation(0), quit(false) {
+		if (workers <= 0) {
+			workers = (int)std::thread::hardware_concurrency() - 1;
+		}
+		for (int i = 0; i < workers; i++) {
+			threads.push_back(std::thread(&ParticleThreadPool::WorkerLoop, this, i + 1));
+		}
+	}
+
+	~ParticleThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < threads.size(); i++) {
+			threads[i].join();
+		}
+	}
+
+	// Number of threads that execute tasks, the caller included
+	int Size() const {
+		return (int)threads.size() + 1;
+	}
+
+	// Call job(task, thread) for every task in [0, taskCount)
+	void Run(int taskCount, const std::function<void(int, int)>& taskJob) {
+		if (threads.empty() || taskCount <= 1) {
+			for (int i = 0; i < taskCount; i++) {
+				taskJob(i, 0);
+			}
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &taskJob;
+			tasks = taskCount;
+			next = 0;
+			busy = (int)threads.size();
+			generation++;
+		}
+		wake.notify_all();
+		Drain(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return busy == 0; });
+		job = NULL;
+	}
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(int, int)>* job;
+	int tasks;
+	std::atomic<int> next;
+	int busy;
+	unsigned int generation;
+	bool quit;
+
+	void Drain(int thread) {
+		for (int task = next++; task < tasks; task = next++) {
+			(*job)(task, thread);
+		}
+	}
+
+	void WorkerLoop(int thread) {
+		unsigned int seen = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this, seen] { return quit || generation != seen; });
+				if (quit) {
+					return;
+				}
+				seen = generation;
+			}
+			Drain(thread);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy--;
+			}
+			done.notify_one();
+		}
+	}
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <math.h>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <common/shader.hpp>
+
+// Rain without particles (--procedural-rain). ProceduralRainVertexShader
+// computes every drop and its splash from the instance index and the time,
+// so there is no pool, no simulation, no sort and no upload : a frame costs
+// one instanced draw whatever the number of drops. Drops follow the closed
+// form of the FallingPhysics motion, and only the roof outline stops them,
+// so the turbulent wind field and the distance field of the car do not
+// apply. Drops are drawn after the merged CPU particles, in no particular
+// order, which is exact with order independent transparency.
+class ProceduralRain {
+public:
+	// Drop slots, each one cycling through a drop and its splash
+	int drops;
+	// Simulated time, in cycles of a slot
+	double cycles;
+
+	ProceduralRain() : drops(0), cycles(0.0), period(1.0f) {
+		programs[0] = programs[1] = 0;
+	}
+
+	// Load the program with each particle fragment shader (blended, then order
+	// independent) and set what stays constant : the emitter, the materials
+	// and the roof, the 4 points of the top outline of the car profile.
+	template <class RainPolicy, class SplashPolicy, class PhysicsPolicy>
+	void Init(int slots, unsigned int seed, const GLfloat* shapes, const GLfloat* layers, int materials, unsigned int rainMaterial, unsigned int splashMaterial,
+		const GLfloat* roof, float roofHalfWidth) {
+		drops = slots;
+		period = RainPolicy::Life() + SplashPolicy::Life();
+		const char* fragmentShaders[2] = { "ParticleFragmentShader.fragmentshader", "ParticleOITFragmentShader.fragmentshader" };
+		glm::vec3 origin = RainPolicy::Origin();
+		unsigned char color[4];
+		RainPolicy::Color(color);
+		for (int i = 0; i < 2; i++) {
+			GLuint program = LoadShaders("ProceduralRainVertexShader.vertexshader", fragmentShaders[i]);
+			programs[i] = program;
+			glUseProgram(program);
+			glUniform1i(glGetUniformLocation(program, "particleTextureSampler"), 0);
+			glUniform3fv(glGetUniformLocation(program, "ParticleShapes"), 4 * materials, shapes);
+			glUniform1fv(glGetUniformLocation(program, "ParticleLayers"), materials, layers);
+			glUniform1ui(glGetUniformLocation(program, "RainMaterial"), rainMaterial);
+			glUniform1ui(glGetUniformLocation(program, "SplashMaterial"), splashMaterial);
+			glUniform1ui(glGetUniformLocation(program, "RainSeed"), seed);
+			glUniform3f(glGetUniformLocation(program, "RainOrigin"), origin.x, origin.y, origin.z);
+			glUniform1f(glGetUniformLocation(program, "RainSpread"), RainPolicy::Spread());
+			glUniform1f(glGetUniformLocation(program, "RainLife"), RainPolicy::Life());
+			glUniform1f(glGetUniformLocation(program, "SplashLife"), SplashPolicy::Life());
+			glUniform1f(glGetUniformLocation(program, "RainGravity"), PhysicsPolicy::Gravity());
+			glUniform4f(glGetUniformLocation(program, "RainColor"), color[0] / 255.0f, color[1] / 255.0f, color[2] / 255.0f, color[3] / 255.0f);
+			glUniform2fv(glGetUniformLocation(program, "RainRoof"), 4, roof);
+			glUniform1f(glGetUniformLocation(program, "RainRoofHalfWidth"), roofHalfWidth);
+			cameraRight[i] = glGetUniformLocation(program, "ParticleCameraRight");
+			cameraUp[i] = glGetUniformLocation(program, "ParticleCameraUp");
+			viewProjection[i] = glGetUniformLocation(program, "ParticleVP");
+			cycleLocation[i] = glGetUniformLocation(program, "RainCycle");
+			fractionLocation[i] = glGetUniformLocation(program, "RainCycleFraction");
+			directionLocation[i] = glGetUniformLocation(program, "RainDirection");
+			sizeScaleLocation[i] = glGetUniformLocation(program, "RainSizeScale");
+		}
+	}
+
+	void Advance(float delta) {
+		cycles += delta / period;
+	}
+
+	// Draw the drops of time back seconds ago (see StageInterpolated), falling
+	// in direction, with the particle atlas in Texture Unit 0. count is cut to
+	// the slots given to Init.
+	void Draw(bool orderIndependent, int count, float back, const glm::vec3& direction, float sizeScale, GLuint atlas, const glm::mat4& view, const glm::mat4& vp) {
+		count = count < drops ? count : drops;
+		if (count <= 0) {
+			return;
+		}
+		int i = orderIndependent ? 1 : 0;
+		glUseProgram(programs[i]);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, atlas);
+		glUniform3f(cameraRight[i], view[0][0], view[1][0], view[2][0]);
+		glUniform3f(cameraUp[i], view[0][1], view[1][1], view[2][1]);
+		glUniformMatrix4fv(viewProjection[i], 1, GL_FALSE, &vp[0][0]);
+		// Whole cycles apart, so the fraction keeps its precision however long it runs
+		double now = cycles - back / period;
+		if (now < 0.0) {
+			now = 0.0;
+		}
+		double whole = floor(now);
+		glUniform1ui(cycleLocation[i], (GLuint)fmod(whole, 4294967296.0));
+		glUniform1f(fractionLocation[i], (float)(now - whole));
+		glUniform3f(directionLocation[i], direction.x, direction.y, direction.z);
+		glUniform1f(sizeScaleLocation[i], sizeScale);
+		// Every value comes from the uniforms and the instance index
+		glDisableVertexAttribArray(0);
+		glDisableVertexAttribArray(1);
+		glDisableVertexAttribArray(2);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+	}
+
+	void Delete() {
+		glDeleteProgram(programs[0]);
+		glDeleteProgram(programs[1]);
+	}
+
+private:
+	// Seconds per cycle : the drop life, then the splash life
+	float period;
+	GLuint programs[2];
+	GLint cameraRight[2], cameraUp[2], viewProjection[2];
+	GLint cycleLocation[2], fractionLocation[2], directionLocation[2], sizeScaleLocation[2];
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <GL/glew.h>
+
+// Ring of per frame regions in one vertex buffer, for data rewritten every
+// frame. With ARB_buffer_storage the buffer is mapped once, persistently and
+// coherently, and the CPU writes straight into it: each region is protected
+// by a fence, so the CPU only waits when the GPU is still reading the region
+// it wants to reuse, three frames later. Without it, Map() hands out a CPU
+// copy and Upload() falls back to orphaning with glBufferData(NULL) +
+// glBufferSubData.
+class StreamBuffer {
+public:
+	static const int Regions = 3;
+	// Frames a region must stay under a quarter full before it shrinks
+	static const int ShrinkFrames = 120;
+
+	GLuint buffer;
+	// Number of Map() calls that had to wait for the GPU
+	int stalls;
+	// Number of times Reserve() reallocated the buffer
+	int resizes;
+
+	StreamBuffer() : buffer(0), stalls(0), resizes(0), regionSize(0), minimumSize(0), underused(0), region(0), persistent(false), mapped(NULL) {
+		for (int i = 0; i < Regions; i++) {
+			fences[i] = 0;
+		}
+	}
+
+	// size is the size of one region, and the smallest Reserve() goes back to
+	void Init(GLsizeiptr size) {
+		minimumSize = size;
+		Create(size);
+	}
+
+	// Make the regions hold at least bytes, before Map(). They grow
+	// geometrically, to twice their size or more, so a rising particle count
+	// reallocates a few times only. They shrink to half once under a quarter
+	// was used for ShrinkFrames frames in a row. The old buffer is deleted,
+	// GL keeps it alive until the draws still reading it are done.
+	void Reserve(GLsizeiptr bytes) {
+		GLsizeiptr size = regionSize;
+		if (bytes > regionSize) {
+			size = bytes > 2 * regionSize ? bytes : 2 * regionSize;
+			underused = 0;
+		}
+		else if (bytes < regionSize / 4 && regionSize / 2 >= minimumSize) {
+			if (++underused >= ShrinkFrames) {
+				size = regionSize / 2;
+				underused = 0;
+			}
+		}
+		else {
+			underused = 0;
+		}
+		if (size != regionSize) {
+			Delete();
+			Create(size);
+			resizes++;
+		}
+	}
+
+	// Move to the next region and return where to write it. Must be called on
+	// the thread owning the GL context; the memory can then be filled from any
+	// thread until the draw.
+	unsigned char* Map() {
+		if (!persistent) {
+			// Orphan the storage, the driver hands out a fresh one
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glBufferData(GL_ARRAY_BUFFER, regionSize, NULL, GL_STREAM_DRAW);
+			return mapped;
+		}
+		region = (region + 1) % Regions;
+		if (fences[region]) {
+			GLenum result = glClientWaitSync(fences[region], 0, 0);
+			if (result == GL_TIMEOUT_EXPIRED) {
+				stalls++;
+				do {
+					result = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+				} while (result == GL_TIMEOUT_EXPIRED);
+			}
+			glDeleteSync(fences[region]);
+			fences[region] = 0;
+		}
+		return mapped + region * regionSize;
+	}
+
+	// Make bytes written at offset in the current region visible to the GPU.
+	// Nothing to do for a coherent mapping.
+	void Upload(GLintptr offset, GLsizeiptr bytes) {
+		if (!persistent && bytes > 0) {
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, mapped + offset);
+		}
+	}
+
+	// Buffer offset of the current region, for glVertexAttribPointer
+	GLintptr Offset() const {
+		return persistent ? region * regionSize : 0;
+	}
+
+	// Call after the last draw reading the current region
+	void Fence() {
+		if (persistent) {
+			fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
+
+	void Delete() {
+		for (int i = 0; i < Regions; i++) {
+			if (fences[i]) {
+				glDeleteSync(fences[i]);
+				fences[i] = 0;
+			}
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		if (persistent) {
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		else {
+			free(mapped);
+		}
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+		mapped = NULL;
+	}
+
+private:
+	GLsizeiptr regionSize;
+	GLsizeiptr minimumSize;
+	int underused;
+	int region;
+	bool persistent;
+	unsigned char* mapped;
+	GLsync fences[Regions];
+
+	void Create(GLsizeiptr size) {
+		// Regions start on 256 bytes, the largest offset alignment a shader
+		// storage binding may need (GpuParticleSorter reads them)
+		regionSize = (size + 255) & ~(GLsizeiptr)255;
+		region = 0;
+		persistent = GLEW_ARB_buffer_storage != 0;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		if (persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_ARRAY_BUFFER, Regions * regionSize, NULL, flags);
+			mapped = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, Regions * regionSize, flags);
+		}
+		else {
+			glBufferData(GL_ARRAY_BUFFER, regionSize, NULL, GL_STREAM_DRAW);
+			mapped = (unsigned char*)malloc(regionSize);
+		}
+	}
+};
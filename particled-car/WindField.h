@@ -0,0 +1,283 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include <immintrin.h>
+
+#include <glm/glm.hpp>
+
+#include "ParticleKernel.h"
+#include "ParticleRandom.h"
+
+// Turbulent wind, as a precomputed curl noise velocity field.
+// A vector potential of smooth periodic value noise is baked on a Size^3
+// grid, and the wind is its curl, taken with central differences on the
+// same periodic grid : the discrete divergence of a discrete curl is zero,
+// so the wind swirls particles around without bunching them up or spreading
+// them out (trilinear sampling between the grid points leaves a small
+// residual only). The grid tiles space every Size * cellSize, and scrolls with
+// Advance() to animate it. Particles sample it trilinearly, at the same cost
+// whatever the noise behind it; sampling per particle noise instead would
+// cost dozens of hashes each.
+
+// Speeds of the particles in [begin, end) += wind at their position * scale.
+// cells holds the x, y, z wind of every cell, offset is the scroll in cells.
+typedef void (*WindSampler)(const float* cells, const glm::vec3& offset, float invCell, ParticlePool& pool, int begin, int end, float scale);
+
+const int WindGridSize = 32;
+const int WindGridMask = WindGridSize - 1;
+
+inline void SampleWindScalar(const float* cells, const glm::vec3& offset, float invCell, ParticlePool& pool, int begin, int end, float scale) {
+	for (int i = begin; i < end; i++) {
+		float gx = pool.posX[i] * invCell + offset.x;
+		float gy = pool.posY[i] * invCell + offset.y;
+		float gz = pool.posZ[i] * invCell + offset.z;
+		float fx = floorf(gx), fy = floorf(gy), fz = floorf(gz);
+		float tx = gx - fx, ty = gy - fy, tz = gz - fz;
+		int x0 = (int)fx & WindGridMask, y0 = (int)fy & WindGridMask, z0 = (int)fz & WindGridMask;
+		int x1 = (x0 + 1) & WindGridMask;
+		int y1 = ((y0 + 1) & WindGridMask) * WindGridSize;
+		int z1 = ((z0 + 1) & WindGridMask) * WindGridSize * WindGridSize;
+		y0 *= WindGridSize;
+		z0 *= WindGridSize * WindGridSize;
+		float wind[3];
+		for (int c = 0; c < 3; c++) {
+			float c000 = cells[3 * (z0 + y0 + x0) + c], c100 = cells[3 * (z0 + y0 + x1) + c];
+			float c010 = cells[3 * (z0 + y1 + x0) + c], c110 = cells[3 * (z0 + y1 + x1) + c];
+			float c001 = cells[3 * (z1 + y0 + x0) + c], c101 = cells[3 * (z1 + y0 + x1) + c];
+			float c011 = cells[3 * (z1 + y1 + x0) + c], c111 = cells[3 * (z1 + y1 + x1) + c];
+			float x00 = c000 + (c100 - c000) * tx;
+			float x10 = c010 + (c110 - c010) * tx;
+			float x01 = c001 + (c101 - c001) * tx;
+			float x11 = c011 + (c111 - c011) * tx;
+			float y0v = x00 + (x10 - x00) * ty;
+			float y1v = x01 + (x11 - x01) * ty;
+			wind[c] = y0v + (y1v - y0v) * tz;
+		}
+		pool.speedX[i] += wind[0] * scale;
+		pool.speedY[i] += wind[1] * scale;
+		pool.speedZ[i] += wind[2] * scale;
+	}
+}
+
+// AVX2 version, 8 particles per iteration, the 8 corners of each component
+// read with gathers. Same operations in the same order as the scalar loop.
+PARTICLE_TARGET_AVX2
+inline void SampleWindAVX2(const float* cells, const glm::vec3& offset, float invCell, ParticlePool& pool, int begin, int end, float scale) {
+	const __m256 inv = _mm256_set1_ps(invCell);
+	const __m256 ox = _mm256_set1_ps(offset.x);
+	const __m256 oy = _mm256_set1_ps(offset.y);
+	const __m256 oz = _mm256_set1_ps(offset.z);
+	const __m256 scales = _mm256_set1_ps(scale);
+	const __m256i mask = _mm256_set1_epi32(WindGridMask);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i three = _mm256_set1_epi32(3);
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 gx = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&pool.posX[i]), inv), ox);
+		__m256 gy = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&pool.posY[i]), inv), oy);
+		__m256 gz = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&pool.posZ[i]), inv), oz);
+		__m256 fx = _mm256_floor_ps(gx), fy = _mm256_floor_ps(gy), fz = _mm256_floor_ps(gz);
+		__m256 tx = _mm256_sub_ps(gx, fx), ty = _mm256_sub_ps(gy, fy), tz = _mm256_sub_ps(gz, fz);
+		__m256i x0 = _mm256_and_si256(_mm256_cvttps_epi32(fx), mask);
+		__m256i y0 = _mm256_and_si256(_mm256_cvttps_epi32(fy), mask);
+		__m256i z0 = _mm256_and_si256(_mm256_cvttps_epi32(fz), mask);
+		__m256i x1 = _mm256_and_si256(_mm256_add_epi32(x0, one), mask);
+		__m256i y1 = _mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(y0, one), mask), 5);
+		__m256i z1 = _mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(z0, one), mask), 10);
+		y0 = _mm256_slli_epi32(y0, 5);
+		z0 = _mm256_slli_epi32(z0, 10);
+		// Float index of the x component of each corner
+		__m256i i000 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z0, y0), x0), three);
+		__m256i i100 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z0, y0), x1), three);
+		__m256i i010 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z0, y1), x0), three);
+		__m256i i110 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z0, y1), x1), three);
+		__m256i i001 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z1, y0), x0), three);
+		__m256i i101 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z1, y0), x1), three);
+		__m256i i011 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z1, y1), x0), three);
+		__m256i i111 = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_add_epi32(z1, y1), x1), three);
+		float* speeds[3] = { &pool.speedX[i], &pool.speedY[i], &pool.speedZ[i] };
+		for (int c = 0; c < 3; c++) {
+			const float* base = cells + c;
+			__m256 c000 = _mm256_i32gather_ps(base, i000, 4), c100 = _mm256_i32gather_ps(base, i100, 4);
+			__m256 c010 = _mm256_i32gather_ps(base, i010, 4), c110 = _mm256_i32gather_ps(base, i110, 4);
+			__m256 c001 = _mm256_i32gather_ps(base, i001, 4), c101 = _mm256_i32gather_ps(base, i101, 4);
+			__m256 c011 = _mm256_i32gather_ps(base, i011, 4), c111 = _mm256_i32gather_ps(base, i111, 4);
+			__m256 x00 = _mm256_add_ps(c000, _mm256_mul_ps(_mm256_sub_ps(c100, c000), tx));
+			__m256 x10 = _mm256_add_ps(c010, _mm256_mul_ps(_mm256_sub_ps(c110, c010), tx));
+			__m256 x01 = _mm256_add_ps(c001, _mm256_mul_ps(_mm256_sub_ps(c101, c001), tx));
+			__m256 x11 = _mm256_add_ps(c011, _mm256_mul_ps(_mm256_sub_ps(c111, c011), tx));
+			__m256 y0v = _mm256_add_ps(x00, _mm256_mul_ps(_mm256_sub_ps(x10, x00), ty));
+			__m256 y1v = _mm256_add_ps(x01, _mm256_mul_ps(_mm256_sub_ps(x11, x01), ty));
+			__m256 wind = _mm256_add_ps(y0v, _mm256_mul_ps(_mm256_sub_ps(y1v, y0v), tz));
+			_mm256_storeu_ps(speeds[c], _mm256_add_ps(_mm256_loadu_ps(speeds[c]), _mm256_mul_ps(wind, scales)));
+		}
+	}
+	SampleWindScalar(cells, offset, invCell, pool, i, end, scale);
+}
+
+// Gathers need AVX2, older CPUs take the scalar loop
+inline WindSampler SelectWindSampler() {
+	return DetectParticleSimd() == ParticleSimdAVX2 ? SampleWindAVX2 : SampleWindScalar;
+}
+
+class WindField {
+public:
+	static const int Size = WindGridSize;
+	static const int Octaves = 2;
+
+	// Strongest acceleration of the field, in units / s^2. 0 turns it off.
+	float amplitude;
+
+	WindField() : amplitude(0.0f), cellSize(1.0f), sampler(SampleWindScalar), offset(0.0f) {
+	}
+
+	// Bake the field for seed, on cells of cell units
+	void Bake(unsigned int seed, float cell) {
+		cellSize = cell;
+		sampler = SelectWindSampler();
+		offset = glm::vec3(0.0f);
+		unsigned int key = RandomHash(seed ^ 0x57494E44u);
+		const int count = Size * Size * Size;
+		std::vector<float> potential(3 * count);
+		for (int z = 0; z < Size; z++) {
+			for (int y = 0; y < Size; y++) {
+				for (int x = 0; x < Size; x++) {
+					for (int c = 0; c < 3; c++) {
+						potential[3 * Cell(x, y, z) + c] = Noise(key, c, x, y, z);
+					}
+				}
+			}
+		}
+		// Curl of the potential, scaled so the strongest wind is 1
+		cells.resize(3 * count);
+		float strongest = 0.0f;
+		for (int z = 0; z < Size; z++) {
+			for (int y = 0; y < Size; y++) {
+				for (int x = 0; x < Size; x++) {
+					const float* px0 = &potential[3 * Cell(x - 1, y, z)];
+					const float* px1 = &potential[3 * Cell(x + 1, y, z)];
+					const float* py0 = &potential[3 * Cell(x, y - 1, z)];
+					const float* py1 = &potential[3 * Cell(x, y + 1, z)];
+					const float* pz0 = &potential[3 * Cell(x, y, z - 1)];
+					const float* pz1 = &potential[3 * Cell(x, y, z + 1)];
+					float* w = &cells[3 * Cell(x, y, z)];
+					w[0] = (py1[2] - py0[2]) - (pz1[1] - pz0[1]);
+					w[1] = (pz1[0] - pz0[0]) - (px1[2] - px0[2]);
+					w[2] = (px1[1] - px0[1]) - (py1[0] - py0[0]);
+					strongest = fmaxf(strongest, sqrtf(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]));
+				}
+			}
+		}
+		if (strongest > 0.0f) {
+			for (int i = 0; i < 3 * count; i++) {
+				cells[i] /= strongest;
+			}
+		}
+	}
+
+	// Scroll the field by velocity * delta. Driven by the simulated steps, so
+	// the fixed timestep replays it exactly.
+	void Advance(float delta, const glm::vec3& velocity) {
+		offset -= velocity * (delta / cellSize);
+		// Keep the offset within one tile so it never loses precision
+		offset -= glm::floor(offset / (float)Size) * (float)Size;
+	}
+
+	// Add the wind at the particles in [begin, end) to their speed for delta
+	// seconds, times response
+	void Apply(ParticlePool& pool, int begin, int end, float delta, float response) const {
+		float scale = amplitude * response * delta;
+		if (scale == 0.0f || cells.empty()) {
+			return;
+		}
+		sampler(&cells[0], offset, 1.0f / cellSize, pool, begin, end, scale);
+	}
+
+	// Run the selected sampler and the scalar loop on the same random
+	// particles and compare the speeds bit for bit, like ValidateParticleKernel
+	bool Validate() const {
+		static ParticlePool reference, tested;
+		const int n = 1003;
+		reference.Reserve(n);
+		tested.Reserve(n);
+		for (int i = 0; i < n; i++) {
+			// Positions over several tiles, negative ones included
+			reference.SetPosition(i, glm::vec3((rand() % 2000 - 1000.0f) / 100.0f, (rand() % 2000 - 1000.0f) / 100.0f, (rand() % 2000 - 1000.0f) / 100.0f));
+			reference.SetSpeed(i, glm::vec3((rand() % 2000 - 1000.0f) / 100.0f, (rand() % 2000 - 1000.0f) / 100.0f, (rand() % 2000 - 1000.0f) / 100.0f));
+		}
+		memcpy(tested.posX, reference.posX, n * sizeof(float));
+		memcpy(tested.posY, reference.posY, n * sizeof(float));
+		memcpy(tested.posZ, reference.posZ, n * sizeof(float));
+		memcpy(tested.speedX, reference.speedX, n * sizeof(float));
+		memcpy(tested.speedY, reference.speedY, n * sizeof(float));
+		memcpy(tested.speedZ, reference.speedZ, n * sizeof(float));
+		// Start at 1 so an unaligned head and a scalar tail are both covered
+		SampleWindScalar(&cells[0], offset, 1.0f / cellSize, reference, 1, n, 0.5f);
+		sampler(&cells[0], offset, 1.0f / cellSize, tested, 1, n, 0.5f);
+		float error = 0.0f;
+		error = fmaxf(error, MaxRelativeError(&reference.speedX[1], &tested.speedX[1], n - 1));
+		error = fmaxf(error, MaxRelativeError(&reference.speedY[1], &tested.speedY[1], n - 1));
+		error = fmaxf(error, MaxRelativeError(&reference.speedZ[1], &tested.speedZ[1], n - 1));
+		bool same = SameFloats(&reference.speedX[1], &tested.speedX[1], n - 1)
+			&& SameFloats(&reference.speedY[1], &tested.speedY[1], n - 1)
+			&& SameFloats(&reference.speedZ[1], &tested.speedZ[1], n - 1);
+		if (!same) {
+			fprintf(stderr, "Wind sampler does not match the scalar loop (error %g)\n", error);
+			return false;
+		}
+		printf("Wind sampler matches the scalar loop exactly\n");
+		return true;
+	}
+
+private:
+	float cellSize;
+	WindSampler sampler;
+	// Scroll, in cells
+	glm::vec3 offset;
+	// x, y, z wind of every cell
+	std::vector<float> cells;
+
+	static int Cell(int x, int y, int z) {
+		return ((z & WindGridMask) * Size + (y & WindGridMask)) * Size + (x & WindGridMask);
+	}
+
+	// Smooth periodic value noise of potential component c at grid point
+	// (x, y, z), octaves of 4, 8, ... lattice cells per tile
+	static float Noise(unsigned int key, int c, int x, int y, int z) {
+		float sum = 0.0f;
+		float weight = 1.0f;
+		for (int o = 0; o < Octaves; o++) {
+			int period = 4 << o;
+			float u = (float)x * period / Size, v = (float)y * period / Size, w = (float)z * period / Size;
+			int ix = (int)u, iy = (int)v, iz = (int)w;
+			float tx = Smooth(u - ix), ty = Smooth(v - iy), tz = Smooth(w - iz);
+			float corner[8];
+			for (int k = 0; k < 8; k++) {
+				int cx = (ix + (k & 1)) % period;
+				int cy = (iy + ((k >> 1) & 1)) % period;
+				int cz = (iz + ((k >> 2) & 1)) % period;
+				unsigned int h = RandomHash(key + (unsigned int)(((c * Octaves + o) * period + cz) * period + cy) * period * RandomGolden + (unsigned int)cx * 0x85EBCA6Bu);
+				corner[k] = (h >> 8) * (2.0f / 16777216.0f) - 1.0f;
+			}
+			float x00 = corner[0] + (corner[1] - corner[0]) * tx;
+			float x10 = corner[2] + (corner[3] - corner[2]) * tx;
+			float x01 = corner[4] + (corner[5] - corner[4]) * tx;
+			float x11 = corner[6] + (corner[7] - corner[6]) * tx;
+			float y0 = x00 + (x10 - x00) * ty;
+			float y1 = x01 + (x11 - x01) * ty;
+			sum += (y0 + (y1 - y0) * tz) * weight;
+			weight *= 0.5f;
+		}
+		return sum;
+	}
+
+	// Quintic fade, continuous up to the second derivative
+	static float Smooth(float t) {
+		return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+	}
+};
@@ -1,8 +1,11 @@
 // Include standard headers
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <math.h>
 #include <algorithm>
+#include <vector>
 
 // Include libraries
 #include <GL/glew.h>
@@ -15,96 +18,233 @@
 #include <common/controls.hpp>
 #include <common/texture.hpp>
 
+// Include headers
+#include "ParticlePool.h"
+#include "ParticleKernel.h"
+#include "ParticleThreads.h"
+#include "ParticleSort.h"
+#include "ParticleCull.h"
+#include "ParticleInstance.h"
+#include "ParticleRandom.h"
+#include "GpuParticles.h"
+#include "GpuParticleSort.h"
+#include "ParticleOIT.h"
+#include "ParticleLowRes.h"
+#include "StreamBuffer.h"
+#include "ParticleAtlas.h"
+#include "ParticleReplay.h"
+#include "CarSDF.h"
+#include "ParticleBudget.h"
+#include "WindField.h"
+#include "ParticleSystem.h"
+#include "ProceduralRain.h"
+
 // Global variables
 GLFWwindow* window;
 
-struct Particle {
-	glm::vec3 pos, speed;
-	unsigned char r, g, b, a;
-	float size, angle, weight;
-	float life;
-	float cameradistance;
-
-	bool operator<(const Particle& that) const {
-		// Sort in reverse order : far particles drawn first.
-		return this->cameradistance > that.cameradistance;
-	}
-};
-
-const int MaxParticles = 10000;
-Particle SmokeParticlesContainer[MaxParticles];
-Particle RainParticlesContainer[MaxParticles];
-Particle SplashParticlesContainer[MaxParticles];
-int LastUsedSmokeParticle = 0;
-int LastUsedRainParticle = 0;
-int LastUsedSplashParticle = 0;
+ParticleKernel SimulateParticles = SimulateParticlesScalar;
+ParticleCuller CullParticles = CullParticlesScalar;
 float windStrength = 0.05f;
+// Depth sort : repair last frame's order unless the camera moved further than
+// the threshold (--sort-threshold X), or always sort from scratch (--no-incremental-sort)
+bool IncrementalParticleSort = true;
+float ParticleSortCameraThreshold = 0.05f;
+// Run the particles on compute shaders (--gpu-particles, needs OpenGL 4.3)
+bool UseGpuParticles = false;
+// Depth sort the CPU particles on the GPU instead (--gpu-sort, needs OpenGL 4.3)
+bool UseGpuSort = false;
+// Weighted blended transparency instead of sorted alpha blending (O key)
+bool OrderIndependentParticles = false;
+// Blend sorted particles at 1 / N of the screen resolution (--particle-res N, P key), 1 = full
+int ParticleResolution = 1;
+// Sort and draw only the CPU particles in the view frustum (--no-cull to turn off)
+bool ParticleFrustumCulling = true;
+// Seed of the particle random streams (--seed N), the same seed gives the same run
+unsigned int ParticleSeed = 1;
+// Fixed timestep for the CPU particles (--fixed-step, implied by --record and
+// --replay). The simulation advances in ParticleStep steps whatever the frame
+// rate, and the particles are drawn interpolated between the last two steps.
+bool FixedParticleStep = false;
+const float ParticleStep = 1.0f / 60.0f;
+// Steps run in one frame at most, the time beyond is dropped after a hitch
+const int MaxParticleSteps = 8;
+// Seed, step and wind of every step (--record file), or played back from it (--replay file)
+ParticleLog ParticleInputLog;
+// Distance field of the car body and wheels, baked at startup
+CarSDF CarDistanceField;
+// Turbulent wind blowing the smoke and rain, baked from the seed at startup.
+// ParticleTurbulence is its strongest acceleration (--turbulence A, 0 = off).
+WindField ParticleWind;
+float ParticleTurbulence = 10.0f;
+// The wind field tiles space every WindGridSize * ParticleWindCell units
+const float ParticleWindCell = 0.125f;
+// Scales the particle workload to hold a frame time (--frame-budget MS, 0 = off)
+ParticleBudget ParticleFrameBudget;
+// Most particles of one CPU pool (--max-particles N). The pools grow to it by
+// chunks as emission needs. The GPU path allocates its slots up front, so it
+// keeps GpuParticleSlots unless the limit is given.
+int ParticleLimit = DefaultParticleLimit;
+int GpuParticleSlots = 10000;
+// Rain computed in the vertex shader instead of CPU particles (--procedural-rain),
+// with this many drop slots (--rain-drops N)
+bool UseProceduralRain = false;
+int ProceduralRainSlots = 2000;
 bool keys[1024];
 
-int FindUnusedSmokeParticle() {
-	for (int i = LastUsedSmokeParticle; i < MaxParticles; i++) {
-		if (SmokeParticlesContainer[i].life < 0) {
-			LastUsedSmokeParticle = i;
-			return i;
-		}
+// Particle effects : where they spawn, how they move and what they do on the car
+struct SmokeEmitter {
+	static glm::vec3 Origin() {
+		return glm::vec3(-0.9f, -0.4f, 0.0f);
 	}
-
-	for (int i = 0; i < LastUsedSmokeParticle; i++) {
-		if (SmokeParticlesContainer[i].life < 0) {
-			LastUsedSmokeParticle = i;
-			return i;
-		}
+	static glm::vec3 Direction(float wind) {
+		return glm::vec3(-10.0f, 0.0f, 0.0f + wind);
 	}
+	static float Spread() {
+		return 1.5f;
+	}
+	static float Life() {
+		return 0.2f;
+	}
+	static void Color(unsigned char color[4]) {
+		color[0] = 147; color[1] = 147; color[2] = 147; color[3] = 255;
+	}
+	static float MinSize() {
+		return 0.1f;
+	}
+	static float MaxSize() {
+		return 0.6f;
+	}
+};
 
-	return 0;
-}
-
-int FindUnusedRainParticle() {
-	for (int i = LastUsedRainParticle; i < MaxParticles; i++) {
-		if (RainParticlesContainer[i].life < 0) {
-			LastUsedRainParticle = i;
-			return i;
-		}
+struct RainEmitter {
+	static glm::vec3 Origin() {
+		return glm::vec3(0.0f, 2.0f, 0.0f);
+	}
+	static glm::vec3 Direction(float wind) {
+		return glm::vec3(0.0f + wind, -10.0f, 0.0f + wind);
+	}
+	static float Spread() {
+		return 5.0f;
+	}
+	static float Life() {
+		return 0.2f;
+	}
+	static void Color(unsigned char color[4]) {
+		color[0] = 64; color[1] = 164; color[2] = 223; color[3] = 255;
 	}
+	static float MinSize() {
+		return 0.1f;
+	}
+	static float MaxSize() {
+		return 0.6f;
+	}
+};
 
-	for (int i = 0; i < LastUsedRainParticle; i++) {
-		if (RainParticlesContainer[i].life < 0) {
-			LastUsedRainParticle = i;
-			return i;
-		}
+// Spawned at rain hits only
+struct SplashEmitter {
+	static float Life() {
+		return 0.1f;
+	}
+	static void Color(unsigned char color[4]) {
+		RainEmitter::Color(color);
+	}
+	static float MinSize() {
+		return 0.1f;
+	}
+	static float MaxSize() {
+		return 0.6f;
 	}
+};
 
-	return 0;
-}
+ParticleSystem<SmokeEmitter, FallingPhysics, SlideCollision> SmokeParticles;
+ParticleSystem<RainEmitter, FallingPhysics, SplashCollision> RainParticles;
+ParticleSystem<SplashEmitter, StillPhysics, NoCollision> SplashParticles;
 
-int FindUnusedSplashParticle() {
-	for (int i = LastUsedSplashParticle; i < MaxParticles; i++) {
-		if (SplashParticlesContainer[i].life < 0) {
-			LastUsedSplashParticle = i;
-			return i;
-		}
-	}
+// Materials of the CPU particles, see ParticleInstance : billboard shape and
+// layer of ParticleAtlas. Splashes use the rain texture.
+enum {
+	SmokeMaterial,
+	RainMaterial,
+	SplashMaterial,
+};
+const GLfloat ParticleMaterialLayers[] = { 0.0f, 1.0f, 1.0f };
+// Instances of the three CPU systems, merged back to front and drawn in one call
+StreamBuffer ParticleStream;
+
+// Roof hits turned into splashes per step at most (--splash-budget N). Hits
+// beyond it are counted in SplashBudgetDropped.
+int SplashBudget = 256;
+int SplashBudgetDropped = 0;
+// Hits of all rain chunks of the current step, in chunk order
+std::vector<glm::vec3> SplashHits;
+
+// Bytes of particle instance data uploaded since the last FPS report
+long long ParticleUploadBytes = 0;
+
+// Checksum of the three CPU particle systems, compared by --replay
+unsigned int ParticleChecksum() {
+	return SplashParticles.pool.Checksum(RainParticles.pool.Checksum(SmokeParticles.pool.Checksum()));
+}
 
-	for (int i = 0; i < LastUsedSplashParticle; i++) {
-		if (SplashParticlesContainer[i].life < 0) {
-			LastUsedSplashParticle = i;
-			return i;
-		}
-	}
+// Point attributes 1 (xyzs) and 2 (color) of ParticleVertexShader at the
+// interleaved ParticleInstance records starting at offset in buffer
+void SetParticleInstanceAttributes(GLuint buffer, GLintptr offset) {
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	// Position object : x + y + z + size as half floats, the size carries the material
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 4, GL_HALF_FLOAT, GL_FALSE, sizeof(ParticleInstance), (void*)(offset + offsetof(ParticleInstance, xyzs)));
+	// Color object : r + g + b + a, normalized to [0, 1] in the shader
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ParticleInstance), (void*)(offset + offsetof(ParticleInstance, color)));
+}
 
-	return 0;
+// Use a ParticleVertexShader program : camera right and up vectors from view,
+// viewProjection matrix, and the particle atlas in Texture Unit 0
+void UseParticleProgram(GLuint program, GLuint cameraRight, GLuint cameraUp, GLuint viewProjection, GLuint atlas, const glm::mat4& view, const glm::mat4& vp) {
+	glUseProgram(program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, atlas);
+	glUniform3f(cameraRight, view[0][0], view[1][0], view[2][0]);
+	glUniform3f(cameraUp, view[0][1], view[1][1], view[2][1]);
+	glUniformMatrix4fv(viewProjection, 1, GL_FALSE, &vp[0][0]);
 }
 
-void SortSmokeParticles() {
-	std::sort(&SmokeParticlesContainer[0], &SmokeParticlesContainer[MaxParticles]);
+// Give a ParticleVertexShader program the billboard (4 vertices, x y z) and
+// atlas layer of each of count materials
+void SetParticleMaterials(GLuint program, const GLfloat* shapes, const GLfloat* layers, int count) {
+	glUseProgram(program);
+	glUniform3fv(glGetUniformLocation(program, "ParticleShapes"), 4 * count, shapes);
+	glUniform1fv(glGetUniformLocation(program, "ParticleLayers"), count, layers);
 }
 
-void SortRainParticles() {
-	std::sort(&RainParticlesContainer[0], &RainParticlesContainer[MaxParticles]);
+// Draw count instances, one per ParticleInstance record of the current region
+// of stream. The vertices of each billboard come from its material.
+void DrawParticleInstances(StreamBuffer& stream, int count) {
+	// Nothing in view : no draw, and the GPU never reads the region
+	if (count == 0) {
+		return;
+	}
+	glDisableVertexAttribArray(0);
+	// Interleaved position and color records
+	SetParticleInstanceAttributes(stream.buffer, stream.Offset());
+	glVertexAttribDivisor(1, 1); // positions : one per quad (its center) -> 1
+	glVertexAttribDivisor(2, 1); // color : one per quad                  -> 1
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+	stream.Fence();
 }
 
-void SortSplashParticles() {
-	std::sort(&SplashParticlesContainer[0], &SplashParticlesContainer[MaxParticles]);
+// Draw count instances in the order of the last GpuParticleSorter::Sort(),
+// which left the records and the sorted pairs bound for the vertex shader
+void DrawSortedParticleInstances(StreamBuffer& stream, int count) {
+	if (count == 0) {
+		return;
+	}
+	// Every instance value is pulled from shader storage
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(2);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+	stream.Fence();
 }
 
 void KeyCallback(GLFWwindow *window, int key, int scancode, int action, int mode)
@@ -114,6 +254,18 @@ void KeyCallback(GLFWwindow *window, int key, int scancode, int action, int mode
 		glfwSetWindowShouldClose(window, GL_TRUE);
 	}
 
+	if (GLFW_KEY_O == key && GLFW_PRESS == action)
+	{
+		OrderIndependentParticles = !OrderIndependentParticles;
+		printf("Particle blending : %s\n", OrderIndependentParticles ? "order independent" : "sorted");
+	}
+
+	if (GLFW_KEY_P == key && GLFW_PRESS == action)
+	{
+		ParticleResolution = ParticleResolution >= 4 ? 1 : ParticleResolution * 2;
+		printf("Particle resolution : 1/%d\n", ParticleResolution);
+	}
+
 	if (key >= 0 && key < 1024)
 	{
 		if (action == GLFW_PRESS)
@@ -140,8 +292,105 @@ void DoMovement() {
 	}
 }
 
-int main(void)
+int main(int argc, char* argv[])
 {
+	const char* recordPath = NULL;
+	const char* replayPath = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--gpu-particles") == 0) {
+			UseGpuParticles = true;
+		}
+		else if (strcmp(argv[i], "--gpu-sort") == 0) {
+			UseGpuSort = true;
+		}
+		else if (strcmp(argv[i], "--sort-threshold") == 0 && i + 1 < argc) {
+			ParticleSortCameraThreshold = std::max((float)atof(argv[++i]), 0.0f);
+		}
+		else if (strcmp(argv[i], "--no-incremental-sort") == 0) {
+			IncrementalParticleSort = false;
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			ParticleSeed = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--splash-budget") == 0 && i + 1 < argc) {
+			SplashBudget = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+			ParticleFrameBudget.targetMs = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--max-particles") == 0 && i + 1 < argc) {
+			ParticleLimit = std::max(atoi(argv[++i]), 1);
+			GpuParticleSlots = ParticleLimit;
+		}
+		else if (strcmp(argv[i], "--turbulence") == 0 && i + 1 < argc) {
+			ParticleTurbulence = std::max((float)atof(argv[++i]), 0.0f);
+		}
+		else if (strcmp(argv[i], "--procedural-rain") == 0) {
+			UseProceduralRain = true;
+		}
+		else if (strcmp(argv[i], "--rain-drops") == 0 && i + 1 < argc) {
+			ProceduralRainSlots = std::max(atoi(argv[++i]), 0);
+		}
+		else if (strcmp(argv[i], "--particle-res") == 0 && i + 1 < argc) {
+			ParticleResolution = std::min(std::max(atoi(argv[++i]), 1), 4);
+		}
+		else if (strcmp(argv[i], "--no-cull") == 0) {
+			ParticleFrustumCulling = false;
+		}
+		else if (strcmp(argv[i], "--fixed-step") == 0) {
+			FixedParticleStep = true;
+		}
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			recordPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replayPath = argv[++i];
+		}
+	}
+	// The replay brings its own seed and settings. The step is built in, so
+	// a log recorded with another one cannot be replayed.
+	if (replayPath != NULL) {
+		if (!ParticleInputLog.OpenReplay(replayPath)) {
+			return -1;
+		}
+		if (ParticleInputLog.header.step != ParticleStep) {
+			fprintf(stderr, "%s was recorded with a %g s step, this build steps %g s\n", replayPath, ParticleInputLog.header.step, ParticleStep);
+			return -1;
+		}
+		ParticleSeed = ParticleInputLog.header.seed;
+		ParticleTurbulence = ParticleInputLog.header.turbulence;
+		SplashBudget = ParticleInputLog.header.splashBudget;
+		ParticleLimit = ParticleInputLog.header.particleLimit;
+		FixedParticleStep = true;
+		printf("Replaying %u particle steps, seed %u\n", ParticleInputLog.header.steps, ParticleSeed);
+	}
+	else if (recordPath != NULL) {
+		if (!ParticleInputLog.OpenRecord(recordPath, ParticleSeed, ParticleStep, ParticleTurbulence, SplashBudget, ParticleLimit)) {
+			return -1;
+		}
+		FixedParticleStep = true;
+	}
+	// The workload must not depend on the machine for a replay to match
+	if (ParticleInputLog.Recording() || ParticleInputLog.Replaying()) {
+		ParticleFrameBudget.targetMs = 0.0f;
+	}
+	if (FixedParticleStep && UseGpuParticles) {
+		fprintf(stderr, "The fixed timestep only applies to CPU particles\n");
+	}
+	if (UseGpuSort && UseGpuParticles) {
+		fprintf(stderr, "The GPU sort only applies to CPU particles\n");
+		UseGpuSort = false;
+	}
+	if (UseProceduralRain && UseGpuParticles) {
+		fprintf(stderr, "The procedural rain only applies to CPU particles\n");
+		UseProceduralRain = false;
+	}
+	// Recordings hold the CPU rain, and their checksum covers it
+	if (UseProceduralRain && (ParticleInputLog.Recording() || ParticleInputLog.Replaying())) {
+		fprintf(stderr, "The procedural rain is not recorded, --record and --replay use CPU rain\n");
+		UseProceduralRain = false;
+	}
+
 	// Initialise GLFW
 	if (!glfwInit())
 	{
@@ -150,13 +399,21 @@ int main(void)
 		return -1;
 	}
 	glfwWindowHint(GLFW_SAMPLES, 4);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	// Compute shaders need OpenGL 4.3
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, UseGpuParticles || UseGpuSort ? 4 : 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	// Open a window and create its OpenGL context
 	window = glfwCreateWindow(1024, 768, "Showroom Car", NULL, NULL);
+	if (window == NULL && (UseGpuParticles || UseGpuSort)) {
+		fprintf(stderr, "OpenGL 4.3 is not available, falling back to CPU particles and sort\n");
+		UseGpuParticles = false;
+		UseGpuSort = false;
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		window = glfwCreateWindow(1024, 768, "Showroom Car", NULL, NULL);
+	}
 	if (window == NULL) {
 		fprintf(stderr, "Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible. Try the 2.1 version of the tutorials.\n");
 		getchar();
@@ -182,6 +439,18 @@ int main(void)
 	glfwPollEvents();
 	glfwSetCursorPos(window, 1024 / 2, 768 / 2);
 
+	// Pick the particle kernel for this CPU
+	SimulateParticles = SelectParticleKernel();
+#ifdef _DEBUG
+	ValidateParticleKernel(SimulateParticles);
+#endif
+	CullParticles = SelectParticleCuller();
+	ParticleWind.Bake(ParticleSeed, ParticleWindCell);
+	ParticleWind.amplitude = ParticleTurbulence;
+#ifdef _DEBUG
+	ParticleWind.Validate();
+#endif
+
 	// Background
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 
@@ -575,12 +844,29 @@ int main(void)
 		1 / sqrt(3), -1 / sqrt(3), -1 / sqrt(3)
 	};
 
-	static GLfloat* smoke_position = new GLfloat[MaxParticles * 4];
-	static GLubyte* smoke_color = new GLubyte[MaxParticles * 4];
-	for (int i = 0; i < MaxParticles; i++) {
-		SmokeParticlesContainer[i].life = -1.0f;
-		SmokeParticlesContainer[i].cameradistance = -1.0f;
+	// Particle simulation runs on all cores
+	ParticleThreadPool ParticleWorkers;
+	std::vector<ParticleChunk> ParticleChunks;
+	printf("Particle threads : %d\n", ParticleWorkers.Size());
+
+	// One random stream per system, and one for the GPU seeds
+	SmokeParticles.Init(ParticleSeed, 0, SimulateParticles, CullParticles, &CarDistanceField, &ParticleWind);
+	RainParticles.Init(ParticleSeed, 1, SimulateParticles, CullParticles, &CarDistanceField, &ParticleWind);
+	SplashParticles.Init(ParticleSeed, 2, SimulateParticles, CullParticles, &CarDistanceField, &ParticleWind);
+	SmokeParticles.pool.limit = RainParticles.pool.limit = SplashParticles.pool.limit = ParticleLimit;
+	SmokeParticles.material = SmokeMaterial;
+	RainParticles.material = RainMaterial;
+	SplashParticles.material = SplashMaterial;
+	// One chunk of instances to start with, it grows with the live particles
+	ParticleStream.Init(ParticlePoolChunk * sizeof(ParticleInstance));
+	ParticleRandom GpuRandom(ParticleSeed, 3);
+	printf("Particle seed : %u\n", ParticleSeed);
+	ParticleSorter* particleSorters[] = { &SmokeParticles.sorter, &RainParticles.sorter, &SplashParticles.sorter };
+	for (int i = 0; i < 3; i++) {
+		particleSorters[i]->incremental = IncrementalParticleSort;
+		particleSorters[i]->cameraThreshold = ParticleSortCameraThreshold;
 	}
+
 	static const GLfloat smoke_vertexes[] = {
 		-0.1f, -0.1f, 0.0f,
 		0.1f, -0.1f, 0.0f,
@@ -588,12 +874,6 @@ int main(void)
 		0.1f, 0.1f, 0.0f,
 	};
 
-	static GLfloat* rain_position = new GLfloat[MaxParticles * 4];
-	static GLubyte* rain_color = new GLubyte[MaxParticles * 4];
-	for (int i = 0; i < MaxParticles; i++) {
-		RainParticlesContainer[i].life = -1.0f;
-		RainParticlesContainer[i].cameradistance = -1.0f;
-	}
 	static const GLfloat rain_vertexes[] = {
 		-0.01f, -0.1f, 0.0f,
 		0.01f, -0.1f, 0.0f,
@@ -601,17 +881,21 @@ int main(void)
 		0.01f, 0.1f, 0.0f,
 	};
 
-	static GLfloat* splash_position = new GLfloat[MaxParticles * 4];
-	static GLubyte* splash_color = new GLubyte[MaxParticles * 4];
-	for (int i = 0; i < MaxParticles; i++) {
-		SplashParticlesContainer[i].life = -1.0f;
-		SplashParticlesContainer[i].cameradistance = -1.0f;
-	}
 	static const GLfloat splash_vertexes[] = {
 		0.0f, 0.0f, 0.0f,
 		-0.2f, 0.1f, 0.0f,
 		0.2f, 0.1f, 0.0f,
 	};
+	SmokeParticles.quadRadius = ParticleQuadRadius(smoke_vertexes, 4);
+	RainParticles.quadRadius = ParticleQuadRadius(rain_vertexes, 4);
+	SplashParticles.quadRadius = ParticleQuadRadius(splash_vertexes, 3);
+	// Billboards of the particle materials as 4 vertex triangle strips, the
+	// splash triangle ends with a degenerate one
+	GLfloat particle_shapes[3 * 4 * 3];
+	memcpy(&particle_shapes[0], smoke_vertexes, sizeof(smoke_vertexes));
+	memcpy(&particle_shapes[12], rain_vertexes, sizeof(rain_vertexes));
+	memcpy(&particle_shapes[24], splash_vertexes, sizeof(splash_vertexes));
+	memcpy(&particle_shapes[33], &splash_vertexes[6], 3 * sizeof(GLfloat));
 
 	/* CAR */
 	// Create Vertex Array Object
@@ -699,6 +983,13 @@ int main(void)
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, FrontwheelEBO);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(frontwheel_elements), frontwheel_elements, GL_STATIC_DRAW);
 
+	// Distance field of the car body and both wheel pairs, for particle collisions
+	CarDistanceField.AddMesh(car_vertexes, sizeof(car_vertexes) / (3 * sizeof(GLfloat)), car_elements, sizeof(car_elements) / sizeof(GLuint));
+	CarDistanceField.AddMesh(backwheel_vertexes, sizeof(backwheel_vertexes) / (3 * sizeof(GLfloat)), backwheel_elements, sizeof(backwheel_elements) / sizeof(GLuint));
+	CarDistanceField.AddMesh(frontwheel_vertexes, sizeof(frontwheel_vertexes) / (3 * sizeof(GLfloat)), frontwheel_elements, sizeof(frontwheel_elements) / sizeof(GLuint));
+	CarDistanceField.Bake(0.025f, 0.05f);
+	printf("Car distance field : %d of %d bricks sampled\n", CarDistanceField.DenseBricks(), CarDistanceField.TotalBricks());
+
 	/* SUN */
 	// Create Vertex Array Object
 	GLuint SunVAO;
@@ -715,63 +1006,6 @@ int main(void)
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, SunEBO);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(sun_elements), sun_elements, GL_STATIC_DRAW);
 
-	/* SMOKE */
-	// Create Vertex Array Object
-	GLuint SmokeVAO;
-	glGenVertexArrays(1, &SmokeVAO);
-	glBindVertexArray(SmokeVAO);
-	// Create a Vertex Buffer Object and copy the vertex data to it
-	GLuint SmokeVBO;
-	glGenBuffers(1, &SmokeVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, SmokeVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(smoke_vertexes), smoke_vertexes, GL_STATIC_DRAW);
-	GLuint SmokePositionVBO;
-	glGenBuffers(1, &SmokePositionVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, SmokePositionVBO);
-	glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-	GLuint SmokeColorVBO;
-	glGenBuffers(1, &SmokeColorVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, SmokeColorVBO);
-	glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW);
-
-	/* RAIN */
-	// Create Vertex Array Object
-	GLuint RainVAO;
-	glGenVertexArrays(1, &RainVAO);
-	glBindVertexArray(RainVAO);
-	// Create a Vertex Buffer Object and copy the vertex data to it
-	GLuint RainVBO;
-	glGenBuffers(1, &RainVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, RainVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(rain_vertexes), rain_vertexes, GL_STATIC_DRAW);
-	GLuint RainPositionVBO;
-	glGenBuffers(1, &RainPositionVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, RainPositionVBO);
-	glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-	GLuint RainColorVBO;
-	glGenBuffers(1, &RainColorVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, RainColorVBO);
-	glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW);
-
-	/* SPLASH */
-	// Create Vertex Array Object
-	GLuint SplashVAO;
-	glGenVertexArrays(1, &SplashVAO);
-	glBindVertexArray(SplashVAO);
-	// Create a Vertex Buffer Object and copy the vertex data to it
-	GLuint SplashVBO;
-	glGenBuffers(1, &SplashVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, SplashVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(splash_vertexes), splash_vertexes, GL_STATIC_DRAW);
-	GLuint SplashPositionVBO;
-	glGenBuffers(1, &SplashPositionVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, SplashPositionVBO);
-	glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-	GLuint SplashColorVBO;
-	glGenBuffers(1, &SplashColorVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, SplashColorVBO);
-	glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW);
-
 	// Create and compile our GLSL program from the shaders
 	GLuint CarProgram = LoadShaders("CarVertexShader.vertexshader", "CarFragmentShader.fragmentshader");
 	GLuint BackwheelProgram = LoadShaders("BackWheelVertexShader.vertexshader", "WheelFragmentShader.fragmentshader");
@@ -779,8 +1013,7 @@ int main(void)
 	GLuint FrontWindowProgram = LoadShaders("FrontWindowVertexShader.vertexshader", "WindowFragmentShader.fragmentshader");
 	GLuint GreyWindowProgram = LoadShaders("GreyWindowVertexShader.vertexshader", "GreyWindowFragmentShader.fragmentshader");
 	GLuint SunProgram = LoadShaders("SunVertexShader.vertexshader", "SunFragmentShader.fragmentshader");
-	GLuint SmokeProgram = LoadShaders("SmokeVertexShader.vertexshader", "SmokeFragmentShader.fragmentshader");
-	GLuint RainProgram = LoadShaders("RainVertexShader.vertexshader", "RainFragmentShader.fragmentshader");
+	GLuint ParticleProgram = LoadShaders("ParticleVertexShader.vertexshader", "ParticleFragmentShader.fragmentshader");
 	// Get a handle for our "MVP" uniform
 	GLuint CarCameraMatrix = glGetUniformLocation(CarProgram, "CarCameraMVP");
 	GLuint CarViewMatrix = glGetUniformLocation(CarProgram, "CarCameraV");
@@ -793,21 +1026,109 @@ int main(void)
 	GLuint GreyWindowCameraMatrix = glGetUniformLocation(GreyWindowProgram, "GreyWindowCameraMVP");
 	GLuint SunMatrix = glGetUniformLocation(SunProgram, "SunMVP");
 	GLuint SunCameraMatrix = glGetUniformLocation(SunProgram, "SunCameraMVP");
-	GLuint SmokeCameraRightMatrix = glGetUniformLocation(SmokeProgram, "SmokeCameraRight");
-	GLuint SmokeCameraUpMatrix = glGetUniformLocation(SmokeProgram, "SmokeCameraUp");
-	GLuint SmokeVPMatrix = glGetUniformLocation(SmokeProgram, "SmokeVP");
-	GLuint RainCameraRightMatrix = glGetUniformLocation(RainProgram, "RainCameraRight");
-	GLuint RainCameraUpMatrix = glGetUniformLocation(RainProgram, "RainCameraUp");
-	GLuint RainVPMatrix = glGetUniformLocation(RainProgram, "RainVP");
+	GLuint ParticleCameraRightMatrix = glGetUniformLocation(ParticleProgram, "ParticleCameraRight");
+	GLuint ParticleCameraUpMatrix = glGetUniformLocation(ParticleProgram, "ParticleCameraUp");
+	GLuint ParticleVPMatrix = glGetUniformLocation(ParticleProgram, "ParticleVP");
+	SetParticleMaterials(ParticleProgram, particle_shapes, ParticleMaterialLayers, 3);
+
+	// Order independent transparency : same vertex shader, the fragment
+	// shader writes the OIT targets instead of blending into the scene
+	ParticleOIT ParticleTransparency;
+	ParticleTransparency.Init();
+	// Low resolution target for the sorted particles
+	ParticleLowRes ParticleLowResolution;
+	ParticleLowResolution.Init();
+	GLuint ParticleOITProgram = LoadShaders("ParticleVertexShader.vertexshader", "ParticleOITFragmentShader.fragmentshader");
+	GLuint ParticleOITCameraRightMatrix = glGetUniformLocation(ParticleOITProgram, "ParticleCameraRight");
+	GLuint ParticleOITCameraUpMatrix = glGetUniformLocation(ParticleOITProgram, "ParticleCameraUp");
+	GLuint ParticleOITVPMatrix = glGetUniformLocation(ParticleOITProgram, "ParticleVP");
+	SetParticleMaterials(ParticleOITProgram, particle_shapes, ParticleMaterialLayers, 3);
+	glUniform1i(glGetUniformLocation(ParticleOITProgram, "particleTextureSampler"), 0);
+
+	// GPU particles : compute programs, one buffer set per system, and draw
+	// programs reading the particle buffers instead of per instance attributes
+	GpuParticlePrograms GpuPrograms;
+	GpuParticleSystem SmokeGpuParticles, RainGpuParticles, SplashGpuParticles;
+	// Rain drops inside this box around the roof spawn splashes
+	GpuParticleSplash GpuSplash = MakeGpuParticleSplash<SplashEmitter>(glm::vec3(-0.9f, 0.55f, -0.5f), glm::vec3(0.9f, 0.65f, 0.5f));
+	GLuint GpuParticleProgram = 0;
+	GLuint GpuOITProgram = 0;
+	// Billboard vertices of each system, attribute 0 of GpuParticleVertexShader.
+	// The CPU path takes them from the material uniforms instead.
+	GLuint SmokeVBO = 0, RainVBO = 0, SplashVBO = 0;
+	if (UseGpuParticles) {
+		printf("Particles : GPU compute\n");
+		glGenBuffers(1, &SmokeVBO);
+		glBindBuffer(GL_ARRAY_BUFFER, SmokeVBO);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(smoke_vertexes), smoke_vertexes, GL_STATIC_DRAW);
+		glGenBuffers(1, &RainVBO);
+		glBindBuffer(GL_ARRAY_BUFFER, RainVBO);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(rain_vertexes), rain_vertexes, GL_STATIC_DRAW);
+		glGenBuffers(1, &SplashVBO);
+		glBindBuffer(GL_ARRAY_BUFFER, SplashVBO);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(splash_vertexes), splash_vertexes, GL_STATIC_DRAW);
+		GpuPrograms.Load();
+		SmokeGpuParticles.Init(4, GpuParticleSlots);
+		RainGpuParticles.Init(4, GpuParticleSlots);
+		SplashGpuParticles.Init(sizeof(splash_vertexes) / (3 * sizeof(GLfloat)), GpuParticleSlots);
+		GpuParticleProgram = LoadShaders("GpuParticleVertexShader.vertexshader", "ParticleFragmentShader.fragmentshader");
+		GpuOITProgram = LoadShaders("GpuParticleVertexShader.vertexshader", "ParticleOITFragmentShader.fragmentshader");
+		// Both sample the atlas in Texture Unit 0
+		glUseProgram(GpuParticleProgram);
+		glUniform1i(glGetUniformLocation(GpuParticleProgram, "particleTextureSampler"), 0);
+		glUseProgram(GpuOITProgram);
+		glUniform1i(glGetUniformLocation(GpuOITProgram, "particleTextureSampler"), 0);
+	}
+
+	// GPU sort : bitonic sort program, and a draw program pulling the
+	// instances in sorted order
+	GpuParticleSorter ParticleGpuSorter;
+	GLuint ParticleSortedProgram = 0;
+	GLuint ParticleSortedCameraRightMatrix = 0;
+	GLuint ParticleSortedCameraUpMatrix = 0;
+	GLuint ParticleSortedVPMatrix = 0;
+	if (UseGpuSort) {
+		printf("Particle sort : GPU compute\n");
+		ParticleGpuSorter.Init();
+#ifdef _DEBUG
+		ValidateGpuParticleSort(ParticleGpuSorter);
+#endif
+		ParticleSortedProgram = LoadShaders("GpuSortedParticleVertexShader.vertexshader", "ParticleFragmentShader.fragmentshader");
+		ParticleSortedCameraRightMatrix = glGetUniformLocation(ParticleSortedProgram, "ParticleCameraRight");
+		ParticleSortedCameraUpMatrix = glGetUniformLocation(ParticleSortedProgram, "ParticleCameraUp");
+		ParticleSortedVPMatrix = glGetUniformLocation(ParticleSortedProgram, "ParticleVP");
+		SetParticleMaterials(ParticleSortedProgram, particle_shapes, ParticleMaterialLayers, 3);
+		glUniform1i(glGetUniformLocation(ParticleSortedProgram, "particleTextureSampler"), 0);
+	}
+
+	// Procedural rain : drops and splashes from the instance index and the
+	// time, stopped by the top outline of the car body (car_vertexes 1 to 4)
+	ProceduralRain RainDrops;
+	if (UseProceduralRain) {
+		printf("Rain : procedural, %d drops\n", ProceduralRainSlots);
+		GLfloat rain_roof[8];
+		for (int i = 0; i < 4; i++) {
+			rain_roof[2 * i + 0] = car_vertexes[3 * (i + 1) + 0];
+			rain_roof[2 * i + 1] = car_vertexes[3 * (i + 1) + 1];
+		}
+		RainDrops.Init<RainEmitter, SplashEmitter, FallingPhysics>(ProceduralRainSlots, ParticleSeed, particle_shapes, ParticleMaterialLayers, 3, RainMaterial, SplashMaterial,
+			rain_roof, half_car_width);
+	}
 
 	// Load the texture using any two methods
 	GLuint Texture = loadBMP_custom("car.bmp");
-	GLuint SmokeTexture = loadBMP_custom("smoke.bmp");
-	GLuint RainTexture = loadBMP_custom("rain.bmp");
+	// The particle textures only go into the atlas
+	GLuint particleTextures[] = { loadBMP_custom("smoke.bmp"), loadBMP_custom("rain.bmp") };
+	ParticleAtlas ParticleTextures;
+	if (!ParticleTextures.Init(particleTextures, 2)) {
+		return -1;
+	}
+	glDeleteTextures(2, particleTextures);
 	// Get a handle for our "myTextureSampler" uniform
 	GLuint TextureID = glGetUniformLocation(CarProgram, "carTextureSampler");
-	GLuint SmokeTextureID = glGetUniformLocation(SmokeProgram, "smokeTextureSampler");
-	GLuint RainTextureID = glGetUniformLocation(RainProgram, "rainTextureSampler");
+	// The particle program always samples texture unit 0
+	glUseProgram(ParticleProgram);
+	glUniform1i(glGetUniformLocation(ParticleProgram, "particleTextureSampler"), 0);
 	// Get a handle for our "LightPosition" uniform
 	GLuint LightID = glGetUniformLocation(CarProgram, "LightPosition_worldspace");
 
@@ -816,8 +1137,15 @@ int main(void)
 	double lastTime = glfwGetTime();
 	double lastTimeFPS = glfwGetTime();
 	int nbFrames = 0;
+	ParticleFrameBudget.Init();
+	// Fixed timestep : simulated time not covered by a whole step yet
+	double particleAccumulator = 0.0;
+	double replayStartTime = glfwGetTime();
 
 	do {
+		double frameStartTime = glfwGetTime();
+		ParticleFrameBudget.BeginFrame();
+
 		// Clear the screen
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		glDisable(GL_BLEND);
@@ -831,6 +1159,57 @@ int main(void)
 		nbFrames++;
 		if (currentTime - lastTimeFPS >= 1.0) {
 			printf("FPS : %f (%f ms/frame)\n", double(nbFrames), 1000.0 / double(nbFrames));
+			printf("Particle sorts : %d repaired, %d full\n",
+				SmokeParticles.sorter.repairs + RainParticles.sorter.repairs + SplashParticles.sorter.repairs,
+				SmokeParticles.sorter.fullSorts + RainParticles.sorter.fullSorts + SplashParticles.sorter.fullSorts);
+			SmokeParticles.sorter.repairs = RainParticles.sorter.repairs = SplashParticles.sorter.repairs = 0;
+			SmokeParticles.sorter.fullSorts = RainParticles.sorter.fullSorts = SplashParticles.sorter.fullSorts = 0;
+			// Report pool exhaustion instead of silently overwriting live particles
+			if (SmokeParticles.pool.dropped + RainParticles.pool.dropped + SplashParticles.pool.dropped > 0) {
+				printf("Dropped particles : smoke %d, rain %d, splash %d\n", SmokeParticles.pool.dropped, RainParticles.pool.dropped, SplashParticles.pool.dropped);
+				SmokeParticles.pool.dropped = 0;
+				RainParticles.pool.dropped = 0;
+				SplashParticles.pool.dropped = 0;
+			}
+			// Particles the frustum test kept out of the sort and upload
+			if (ParticleFrustumCulling) {
+				printf("Frustum culling : %d particles/frame culled, off screen frames smoke %d, rain %d, splash %d\n",
+					(SmokeParticles.culled + RainParticles.culled + SplashParticles.culled) / nbFrames,
+					SmokeParticles.offscreenFrames, RainParticles.offscreenFrames, SplashParticles.offscreenFrames);
+				SmokeParticles.culled = RainParticles.culled = SplashParticles.culled = 0;
+				SmokeParticles.offscreenFrames = RainParticles.offscreenFrames = SplashParticles.offscreenFrames = 0;
+			}
+			// State of the frame budget controller
+			if (ParticleFrameBudget.targetMs > 0.0f) {
+				printf("Particle budget : scale %.2f, frame %.2f ms (target %.1f), simulate %.2f ms, sort %.2f ms, draw %.2f ms\n",
+					ParticleFrameBudget.scale, ParticleFrameBudget.smoothedMs, ParticleFrameBudget.targetMs,
+					ParticleFrameBudget.simulateMs, ParticleFrameBudget.sortMs, ParticleFrameBudget.drawMs);
+			}
+			if (SplashBudgetDropped > 0) {
+				printf("Splashes over budget : %d\n", SplashBudgetDropped);
+				SplashBudgetDropped = 0;
+			}
+			// Instance upload, and what the former float xyzs + byte color streams would have taken
+			if (ParticleUploadBytes > 0) {
+				long long particleUploads = ParticleUploadBytes / sizeof(ParticleInstance);
+				printf("Particle upload : %.1f KB/frame (%.1f KB/frame as float + byte streams)\n",
+					ParticleUploadBytes / 1024.0 / nbFrames,
+					particleUploads * (4 * sizeof(GLfloat) + 4 * sizeof(GLubyte)) / 1024.0 / nbFrames);
+				ParticleUploadBytes = 0;
+			}
+			// Pool capacity follows the live particles, by chunks
+			printf("Particle pools : smoke %d/%d, rain %d/%d, splash %d/%d live/capacity\n",
+				SmokeParticles.pool.count, SmokeParticles.pool.capacity, RainParticles.pool.count, RainParticles.pool.capacity,
+				SplashParticles.pool.count, SplashParticles.pool.capacity);
+			if (ParticleStream.resizes > 0) {
+				printf("Stream buffer resizes : %d\n", ParticleStream.resizes);
+				ParticleStream.resizes = 0;
+			}
+			// Frames where the CPU caught up with the GPU on a stream buffer region
+			if (ParticleStream.stalls > 0) {
+				printf("Stream buffer stalls : %d\n", ParticleStream.stalls);
+				ParticleStream.stalls = 0;
+			}
 			nbFrames = 0;
 			lastTimeFPS += 1.0; 
 		}
@@ -1024,7 +1403,7 @@ int main(void)
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, SunEBO);
 		glDrawElements(GL_TRIANGLES, sizeof(sun_elements), GL_UNSIGNED_INT, 0);
 
-		/* SMOKE */
+		/* SMOKE EMISSION */
 		// Setup camera matrix
 		computeMatricesFromInputs();
 		glm::mat4 SmokeProjectionMatrix = getProjectionMatrix();
@@ -1037,115 +1416,7 @@ int main(void)
 			smokeNewparticles = (int)(0.016f*10000.0);
 		}
 		DoMovement();
-		for (int i = 0; i < smokeNewparticles; i++) {
-			int smokeParticleIndex = FindUnusedSmokeParticle();
-			SmokeParticlesContainer[smokeParticleIndex].life = 0.2f;
-			SmokeParticlesContainer[smokeParticleIndex].pos = glm::vec3(-0.9f, -0.4f, 0.0f);
-			float smokeSpread = 1.5f;
-			glm::vec3 smokeMaindir = glm::vec3(-10.0f, 0.0f, 0.0f+windStrength);
-			// Random direction
-			glm::vec3 smokeRandomdir = glm::vec3(
-				(rand() % 2000 - 1000.0f) / 1000.0f,
-				(rand() % 2000 - 1000.0f) / 1000.0f,
-				(rand() % 2000 - 1000.0f) / 1000.0f
-			);
-			SmokeParticlesContainer[smokeParticleIndex].speed = smokeMaindir + smokeRandomdir * smokeSpread;
-			// Random color
-			SmokeParticlesContainer[smokeParticleIndex].r = 147;
-			SmokeParticlesContainer[smokeParticleIndex].g = 147;
-			SmokeParticlesContainer[smokeParticleIndex].b = 147;
-			SmokeParticlesContainer[smokeParticleIndex].a = 255;
-			SmokeParticlesContainer[smokeParticleIndex].size = (rand() % 1000) / 2000.0f + 0.1f;
-		}
-		// Simulate all particles
-		int smokeParticlesCount = 0;
-		for (int i = 0; i < MaxParticles; i++) {
-			Particle& p = SmokeParticlesContainer[i];
-			if (p.life > 0.0f) {
-				// Decrease life
-				p.life -= delta;
-				if (p.life > 0.0f) {
-					// Simulate simple physics : gravity only, no collisions
-					p.speed += glm::vec3(0.0f, -9.81f, 0.0f) * (float)delta * 0.5f;
-					p.pos += p.speed * (float)delta;
-					p.cameradistance = glm::length2(p.pos - SmokeCameraPosition);
-					// Fill the GPU buffer
-					smoke_position[4 * smokeParticlesCount + 0] = p.pos.x;
-					smoke_position[4 * smokeParticlesCount + 1] = p.pos.y;
-					smoke_position[4 * smokeParticlesCount + 2] = p.pos.z;
-					smoke_position[4 * smokeParticlesCount + 3] = p.size;
-					smoke_color[4 * smokeParticlesCount + 0] = p.r;
-					smoke_color[4 * smokeParticlesCount + 1] = p.g;
-					smoke_color[4 * smokeParticlesCount + 2] = p.b;
-					smoke_color[4 * smokeParticlesCount + 3] = p.a;
-				}
-				else {
-					// Particles that just died will be put at the end of the buffer in SortParticles()
-					p.cameradistance = -1.0f;
-				}
-				smokeParticlesCount++;
-			}
-		}
-		SortSmokeParticles();
-		// Use our shader
-		glUseProgram(SmokeProgram);
-		// Bind our texture in Texture Unit 0
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, SmokeTexture);
-		// Set our "myTextureSampler" sampler to use Texture Unit 0
-		glUniform1i(SmokeTextureID, 0);
-		// Send our transformation to the currently bound shader, 
-		// in the "MVP" uniform
-		glUniform3f(SmokeCameraRightMatrix, SmokeViewMatrix[0][0], SmokeViewMatrix[1][0], SmokeViewMatrix[2][0]);
-		glUniform3f(SmokeCameraUpMatrix, SmokeViewMatrix[0][1], SmokeViewMatrix[1][1], SmokeViewMatrix[2][1]);
-		glUniformMatrix4fv(SmokeVPMatrix, 1, GL_FALSE, &SmokeViewProjectionMatrix[0][0]);
-		// Draw object
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glBindBuffer(GL_ARRAY_BUFFER, SmokePositionVBO);
-		glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, smokeParticlesCount * sizeof(GLfloat) * 4, smoke_position);
-		glBindBuffer(GL_ARRAY_BUFFER, SmokeColorVBO);
-		glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, smokeParticlesCount * sizeof(GLubyte) * 4, smoke_color);
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, SmokeVBO);
-		glVertexAttribPointer(
-			0,                  // attribute. No particular reason for 0, but must match the layout in the shader.
-			3,                  // size
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-		);
-		// Position object
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, SmokePositionVBO);
-		glVertexAttribPointer(
-			1,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-			4,                                // size : x + y + z + size => 4
-			GL_FLOAT,                         // type
-			GL_FALSE,                         // normalized?
-			0,                                // stride
-			(void*)0                          // array buffer offset
-		);
-		// Color object
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, SmokeColorVBO);
-		glVertexAttribPointer(
-			2,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-			4,                                // size : r + g + b + a => 4
-			GL_UNSIGNED_BYTE,                 // type
-			GL_TRUE,                          // normalized?    *** YES, this means that the unsigned char[4] will be accessible with a vec4 (floats) in the shader ***
-			0,                                // stride
-			(void*)0                          // array buffer offset
-		);
-		glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
-		glVertexAttribDivisor(1, 1); // positions : one per quad (its center)                 -> 1
-		glVertexAttribDivisor(2, 1); // color : one per quad                                  -> 1
-		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, smokeParticlesCount);
-
-		/* RAIN */
+		/* RAIN EMISSION */
 		// Setup camera matrix
 		computeMatricesFromInputs();
 		glm::mat4 RainProjectionMatrix = getProjectionMatrix();
@@ -1157,218 +1428,268 @@ int main(void)
 		if (rainNewparticles > (int)(0.016f*10000.0)) {
 			rainNewparticles = (int)(0.016f*10000.0);
 		}
-		for (int i = 0; i < rainNewparticles; i++) {
-			int rainParticleIndex = FindUnusedRainParticle();
-			RainParticlesContainer[rainParticleIndex].life = 0.2f;
-			RainParticlesContainer[rainParticleIndex].pos = glm::vec3(0.0f, 2.0f, 0.0f);
-			float rainSpread = 5.0f;
-			glm::vec3 rainMaindir = glm::vec3(0.0f+windStrength, -10.0f, 0.0f+windStrength);
-			// Random direction
-			glm::vec3 rainRandomdir = glm::vec3(
-				(rand() % 2000 - 1000.0f) / 1000.0f,
-				(rand() % 2000 - 1000.0f) / 1000.0f,
-				(rand() % 2000 - 1000.0f) / 1000.0f
-			);
-			RainParticlesContainer[rainParticleIndex].speed = rainMaindir + rainRandomdir * rainSpread;
-			// Random color
-			RainParticlesContainer[rainParticleIndex].r = 64;
-			RainParticlesContainer[rainParticleIndex].g = 164;
-			RainParticlesContainer[rainParticleIndex].b = 223;
-			RainParticlesContainer[rainParticleIndex].a = 255;
-			RainParticlesContainer[rainParticleIndex].size = (rand() % 1000) / 2000.0f + 0.1f;
+		// Fewer particles when the frames run over the budget
+		smokeNewparticles = ParticleFrameBudget.Emission(smokeNewparticles);
+		rainNewparticles = ParticleFrameBudget.Emission(rainNewparticles);
+		double particleSimulateTime = 0.0;
+		double particleSortTime = 0.0;
+		// Order independent blending has its own targets, at full resolution
+		bool lowResParticles = ParticleResolution > 1 && !OrderIndependentParticles;
+		if (OrderIndependentParticles || lowResParticles) {
+			int framebufferWidth, framebufferHeight;
+			glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+			if (OrderIndependentParticles) {
+				ParticleTransparency.Begin(framebufferWidth, framebufferHeight);
+			}
+			else {
+				ParticleLowResolution.divisor = ParticleResolution;
+				ParticleLowResolution.Begin(framebufferWidth, framebufferHeight);
+			}
+		}
+		if (UseGpuParticles) {
+			/* GPU PARTICLES */
+			// Spawn, simulate and draw without touching particle data on the CPU.
+			// Rain hitting the roof spawns splashes inside the rain pass, the
+			// splash pass then ages them this same frame.
+			ParticleFrameBudget.BeginDraw();
+			// Same emitters and physics as the CPU systems
+			SmokeGpuParticles.Emit(GpuPrograms, smokeNewparticles, MakeGpuParticleEmitter<SmokeEmitter>(windStrength), GpuRandom.Next());
+			RainGpuParticles.Emit(GpuPrograms, rainNewparticles, MakeGpuParticleEmitter<RainEmitter>(windStrength), GpuRandom.Next());
+			SmokeGpuParticles.Simulate(GpuPrograms, (float)delta, FallingPhysics::Gravity(), NULL, NULL, GpuRandom.Next());
+			RainGpuParticles.Simulate(GpuPrograms, (float)delta, FallingPhysics::Gravity(), &SplashGpuParticles, &GpuSplash, GpuRandom.Next());
+			SplashGpuParticles.Simulate(GpuPrograms, (float)delta, StillPhysics::Gravity(), NULL, NULL, GpuRandom.Next());
+
+			// Only the quad vertices come from a vertex buffer. The OIT and low
+			// resolution targets set their own blending.
+			if (!OrderIndependentParticles && !lowResParticles) {
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			}
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, ParticleTextures.texture);
+			glDisableVertexAttribArray(1);
+			glDisableVertexAttribArray(2);
+			glEnableVertexAttribArray(0);
+			glVertexAttribDivisor(0, 0);
+			glUseProgram(OrderIndependentParticles ? GpuOITProgram : GpuParticleProgram);
+
+			glUniform1f(GpuLayerLocation, ParticleMaterialLayers[SmokeMaterial]);
+			glUniform3f(GpuCameraRightLocation, SmokeViewMatrix[0][0], SmokeViewMatrix[1][0], SmokeViewMatrix[2][0]);
+			glUniform3f(GpuCameraUpLocation, SmokeViewMatrix[0][1], SmokeViewMatrix[1][1], SmokeViewMatrix[2][1]);
+			glUniformMatrix4fv(GpuVPLocation, 1, GL_FALSE, &SmokeViewProjectionMatrix[0][0]);
+			glBindBuffer(GL_ARRAY_BUFFER, SmokeVBO);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+			SmokeGpuParticles.Draw(GL_TRIANGLE_STRIP);
+
+			glUniform1f(GpuLayerLocation, ParticleMaterialLayers[RainMaterial]);
+			glUniform3f(GpuCameraRightLocation, RainViewMatrix[0][0], RainViewMatrix[1][0], RainViewMatrix[2][0]);
+			glUniform3f(GpuCameraUpLocation, RainViewMatrix[0][1], RainViewMatrix[1][1], RainViewMatrix[2][1]);
+			glUniformMatrix4fv(GpuVPLocation, 1, GL_FALSE, &RainViewProjectionMatrix[0][0]);
+			glBindBuffer(GL_ARRAY_BUFFER, RainVBO);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+			RainGpuParticles.Draw(GL_TRIANGLE_STRIP);
+			glUniform1f(GpuLayerLocation, ParticleMaterialLayers[SplashMaterial]);
+			glBindBuffer(GL_ARRAY_BUFFER, SplashVBO);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+			SplashGpuParticles.Draw(GL_TRIANGLE_STRIP);
 		}
-		// Simulate all particles
-		int rainParticlesCount = 0;
-		for (int i = 0; i < MaxParticles; i++) {
-			Particle& p = RainParticlesContainer[i];
-			if (p.life > 0.0f) {
-				// Decrease life
-				p.life -= delta;
-				if (p.life > 0.0f) {
-					// Simulate simple physics : gravity only, no collisions
-					p.speed += glm::vec3(0.0f, -9.81f, 0.0f) * (float)delta * 0.5f;
-					p.pos += p.speed * (float)delta;
-					p.cameradistance = glm::length2(p.pos - RainCameraPosition);
-					// Fill the GPU buffer
-					rain_position[4 * rainParticlesCount + 0] = p.pos.x;
-					rain_position[4 * rainParticlesCount + 1] = p.pos.y;
-					rain_position[4 * rainParticlesCount + 2] = p.pos.z;
-					rain_position[4 * rainParticlesCount + 3] = p.size;
-					rain_color[4 * rainParticlesCount + 0] = p.r;
-					rain_color[4 * rainParticlesCount + 1] = p.g;
-					rain_color[4 * rainParticlesCount + 2] = p.b;
-					rain_color[4 * rainParticlesCount + 3] = p.a;
-					// Collision
-					if (p.pos.x >= -0.9f && p.pos.x <= 0.9f && p.pos.y >= 0.55f && p.pos.y <= 0.65f && p.pos.z >= -0.5f && p.pos.z <= 0.5f) {
-						int splashParticleIndex = FindUnusedSplashParticle();
-						SplashParticlesContainer[splashParticleIndex].life = 0.1f;
-						SplashParticlesContainer[splashParticleIndex].pos = glm::vec3(p.pos.x, p.pos.y, p.pos.z);
-						SplashParticlesContainer[splashParticleIndex].speed = glm::vec3(0.0f, 0.0f, 0.0f);
-						// Random color
-						SplashParticlesContainer[splashParticleIndex].r = 64;
-						SplashParticlesContainer[splashParticleIndex].g = 164;
-						SplashParticlesContainer[splashParticleIndex].b = 223;
-						SplashParticlesContainer[splashParticleIndex].a = 255;
-						SplashParticlesContainer[splashParticleIndex].size = (rand() % 1000) / 2000.0f + 0.1f;
+		else {
+			/* CPU PARTICLES */
+			// Variable step : one step of the frame time. Fixed step : as many
+			// ParticleStep steps as the accumulated time covers, or exactly one per
+			// frame when replaying so the replay runs as fast as the machine allows.
+			// Pools are compacted after each fixed step, so the particles after N
+			// steps do not depend on how the steps were spread over frames.
+			int particleSteps = 1;
+			float particleDelta = (float)delta;
+			if (FixedParticleStep) {
+				particleDelta = ParticleStep;
+				if (!ParticleInputLog.Replaying()) {
+					particleAccumulator += delta;
+					particleSteps = (int)(particleAccumulator / ParticleStep);
+					if (particleSteps > MaxParticleSteps) {
+						particleSteps = MaxParticleSteps;
+						particleAccumulator = MaxParticleSteps * ParticleStep;
 					}
+					particleAccumulator -= particleSteps * ParticleStep;
+				}
+				smokeNewparticles = rainNewparticles = ParticleFrameBudget.Emission((int)(ParticleStep*10000.0));
+			}
+			// New particles shrink with the budget scale too
+			float particleSizeScale = ParticleFrameBudget.SizeScale();
+			double simulateStartTime = glfwGetTime();
+			for (int particleStep = 0; particleStep < particleSteps; particleStep++) {
+				if (ParticleInputLog.Replaying() && !ParticleInputLog.ReplayStep(windStrength)) {
+					// Every step was replayed
+					double replayTime = glfwGetTime() - replayStartTime;
+					unsigned int checksum = ParticleChecksum();
+					printf("Replay : %u steps in %.3f s (%.3f ms/step)\n", ParticleInputLog.steps, replayTime, 1000.0 * replayTime / std::max(ParticleInputLog.steps, 1u));
+					printf("Replay checksum : %08x, recorded %08x, %s\n", checksum, ParticleInputLog.header.checksum,
+						checksum == ParticleInputLog.header.checksum ? "identical" : "DIFFERENT");
+					glfwSetWindowShouldClose(window, GL_TRUE);
+					break;
+				}
+				if (ParticleInputLog.Recording()) {
+					ParticleInputLog.RecordStep(windStrength);
+				}
+				// The turbulence drifts with the wind, a step at a time so a replay
+				// scrolls it the same
+				ParticleWind.Advance(particleDelta, glm::vec3(windStrength, 0.25f, windStrength));
+				// Spawns left under the live particle cap of the budget
+				SmokeParticles.Emit(ParticleFrameBudget.Spawns(SmokeParticles.pool, SmokeParticles.spawnBase, smokeNewparticles), windStrength, particleSizeScale);
+				// Procedural rain only needs the time, its pools stay empty
+				if (UseProceduralRain) {
+					RainDrops.Advance(particleDelta);
 				}
 				else {
-					// Particles that just died will be put at the end of the buffer in SortParticles()
-					p.cameradistance = -1.0f;
+					RainParticles.Emit(ParticleFrameBudget.Spawns(RainParticles.pool, RainParticles.spawnBase, rainNewparticles), windStrength, particleSizeScale);
+				}
+				/* PARTICLE SIMULATION */
+				// Cut every system into chunks and simulate them on the thread pool.
+				// The kernel writes each staging record at its particle index, so chunks
+				// fill disjoint ranges of the staging arrays. Rain chunks collect the
+				// drops hitting the car in their own buffer, which are turned into
+				// splashes afterwards.
+				int particleChunkCount = 0;
+				particleChunkCount = SmokeParticles.AddChunks(ParticleChunks, particleChunkCount, SmokeCameraPosition);
+				particleChunkCount = RainParticles.AddChunks(ParticleChunks, particleChunkCount, RainCameraPosition);
+				particleChunkCount = SplashParticles.AddChunks(ParticleChunks, particleChunkCount, RainCameraPosition);
+				ParticleWorkers.Run(particleChunkCount, [&](int task, int) {
+					ParticleChunks[task].simulate(ParticleChunks[task], particleDelta);
+				});
+				// Collect the hits of all chunks in chunk order, up to the splash
+				// budget, then spawn them in one batch
+				int splashFirstNew = SplashParticles.pool.count;
+				SplashHits.clear();
+				for (int task = 0; task < particleChunkCount; task++) {
+					ParticleChunk& c = ParticleChunks[task];
+					int room = std::max(SplashBudget - (int)SplashHits.size(), 0);
+					int taken = std::min((int)c.hits.size(), room);
+					SplashHits.insert(SplashHits.end(), c.hits.begin(), c.hits.begin() + taken);
+					SplashBudgetDropped += (int)c.hits.size() - taken;
+				}
+				if (!SplashHits.empty()) {
+					SplashParticles.EmitAt(&SplashHits[0], (int)SplashHits.size());
+				}
+				// New splashes live through this frame too
+				SplashParticles.Simulate(splashFirstNew, SplashParticles.pool.count, particleDelta, RainCameraPosition);
+				// The compaction after the sort trims the pools, once per frame
+				if (FixedParticleStep) {
+					SmokeParticles.Compact(false);
+					RainParticles.Compact(false);
+					SplashParticles.Compact(false);
 				}
-				rainParticlesCount++;
 			}
-		}
-		SortRainParticles();
-		// Use our shader
-		glUseProgram(RainProgram);
-		// Bind our texture in Texture Unit 0
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, RainTexture);
-		// Set our "myTextureSampler" sampler to use Texture Unit 0
-		glUniform1i(RainTextureID, 0);
-		// Send our transformation to the currently bound shader, 
-		// in the "MVP" uniform
-		glUniform3f(RainCameraRightMatrix, RainViewMatrix[0][0], RainViewMatrix[1][0], RainViewMatrix[2][0]);
-		glUniform3f(RainCameraUpMatrix, RainViewMatrix[0][1], RainViewMatrix[1][1], RainViewMatrix[2][1]);
-		glUniformMatrix4fv(RainVPMatrix, 1, GL_FALSE, &RainViewProjectionMatrix[0][0]);
-		// Draw object
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glBindBuffer(GL_ARRAY_BUFFER, RainPositionVBO);
-		glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, rainParticlesCount * sizeof(GLfloat) * 4, rain_position);
-		glBindBuffer(GL_ARRAY_BUFFER, RainColorVBO);
-		glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, rainParticlesCount * sizeof(GLubyte) * 4, rain_color);
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, RainVBO);
-		glVertexAttribPointer(
-			0,                  // attribute. No particular reason for 0, but must match the layout in the shader.
-			3,                  // size
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-		);
-		// Position object
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, RainPositionVBO);
-		glVertexAttribPointer(
-			1,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-			4,                                // size : x + y + z + size => 4
-			GL_FLOAT,                         // type
-			GL_FALSE,                         // normalized?
-			0,                                // stride
-			(void*)0                          // array buffer offset
-		);
-		// Color object
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, RainColorVBO);
-		glVertexAttribPointer(
-			2,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-			4,                                // size : r + g + b + a => 4
-			GL_UNSIGNED_BYTE,                 // type
-			GL_TRUE,                          // normalized?    *** YES, this means that the unsigned char[4] will be accessible with a vec4 (floats) in the shader ***
-			0,                                // stride
-			(void*)0                          // array buffer offset
-		);
-		glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
-		glVertexAttribDivisor(1, 1); // positions : one per quad (its center)                 -> 1
-		glVertexAttribDivisor(2, 1); // color : one per quad                                  -> 1
-		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, rainParticlesCount);
-
-		/* SPLASH */
-		// Simulate all particles
-		int splashParticlesCount = 0;
-		for (int i = 0; i < MaxParticles; i++) {
-			Particle& p = SplashParticlesContainer[i];
-			if (p.life > 0.0f) {
-				// Decrease life
-				p.life -= delta;
-				if (p.life > 0.0f) {
-					p.cameradistance = glm::length2(p.pos - RainCameraPosition);
-					// Fill the GPU buffer
-					splash_position[4 * splashParticlesCount + 0] = p.pos.x;
-					splash_position[4 * splashParticlesCount + 1] = p.pos.y;
-					splash_position[4 * splashParticlesCount + 2] = p.pos.z;
-					splash_position[4 * splashParticlesCount + 3] = p.size;
-					splash_color[4 * splashParticlesCount + 0] = p.r;
-					splash_color[4 * splashParticlesCount + 1] = p.g;
-					splash_color[4 * splashParticlesCount + 2] = p.b;
-					splash_color[4 * splashParticlesCount + 3] = p.a;
+			particleSimulateTime = glfwGetTime() - simulateStartTime;
+			double sortStartTime = glfwGetTime();
+			// Fixed step : recompute the staging records and camera distances of
+			// the live particles at the drawn time, between the last two steps
+			float back = 0.0f;
+			if (FixedParticleStep) {
+				back = ParticleInputLog.Replaying() ? 0.0f : ParticleStep - (float)particleAccumulator;
+				SmokeParticles.StageInterpolated(back, SmokeCameraPosition);
+				RainParticles.StageInterpolated(back, RainCameraPosition);
+				SplashParticles.StageInterpolated(back, RainCameraPosition);
+			}
+			// The three sorts are independent. Each one orders the live particles
+			// back to front, and keeps the order for the next frame. Order
+			// independent blending needs no sort, and the GPU sort orders them
+			// all after the upload, so the live particles are taken in pool order.
+			// Particles out of view are left out before the sort
+			ParticleFrustum smokeFrustum, rainFrustum;
+			smokeFrustum.Extract(SmokeViewProjectionMatrix);
+			rainFrustum.Extract(RainViewProjectionMatrix);
+			const ParticleFrustum* smokeCull = ParticleFrustumCulling ? &smokeFrustum : NULL;
+			const ParticleFrustum* rainCull = ParticleFrustumCulling ? &rainFrustum : NULL;
+			int visibleCount[3];
+			bool gpuSort = UseGpuSort && !OrderIndependentParticles;
+			bool sortParticles = !OrderIndependentParticles && !gpuSort;
+			ParticleWorkers.Run(3, [&](int task, int) {
+				switch (task) {
+				case 0:
+					visibleCount[0] = SmokeParticles.SortVisible(SmokeCameraPosition, sortParticles, smokeCull);
+					break;
+				case 1:
+					visibleCount[1] = RainParticles.SortVisible(RainCameraPosition, sortParticles, rainCull);
+					break;
+				default:
+					visibleCount[2] = SplashParticles.SortVisible(RainCameraPosition, sortParticles, rainCull);
+					break;
 				}
-				else {
-					// Particles that just died will be put at the end of the buffer in SortParticles()
-					p.cameradistance = -1.0f;
+			});
+			// The sorted runs are merged back to front, so smoke, rain and
+			// splashes also blend in the right order against each other, and
+			// their records are written straight into this frame's region of
+			// the shared stream buffer
+			ParticleRun particleRuns[] = { SmokeParticles.VisibleRun(visibleCount[0]), RainParticles.VisibleRun(visibleCount[1]), SplashParticles.VisibleRun(visibleCount[2]) };
+			ParticleStream.Reserve((visibleCount[0] + visibleCount[1] + visibleCount[2]) * sizeof(ParticleInstance));
+			ParticleInstance* instances = (ParticleInstance*)ParticleStream.Map();
+			int particlesCount = GatherMergedParticles(particleRuns, 3, sortParticles, instances);
+			ParticleStream.Upload(0, particlesCount * sizeof(ParticleInstance));
+			ParticleUploadBytes += particlesCount * sizeof(ParticleInstance);
+			if (gpuSort) {
+				ParticleGpuSorter.Sort(ParticleStream.buffer, ParticleStream.Offset(), particlesCount, RainCameraPosition);
+			}
+			// Then drop the dead particles, keeping the sort orders
+			ParticleWorkers.Run(3, [&](int task, int) {
+				switch (task) {
+				case 0:
+					SmokeParticles.Compact(true);
+					break;
+				case 1:
+					RainParticles.Compact(true);
+					break;
+				default:
+					SplashParticles.Compact(true);
+					break;
 				}
-				splashParticlesCount++;
+			});
+			particleSortTime = glfwGetTime() - sortStartTime;
+			ParticleFrameBudget.BeginDraw();
+
+			/* PARTICLES */
+			// Smoke, rain and splashes in one draw, each with the shape and atlas
+			// layer of its material. The smoke and rain views are computed from
+			// the same input one after the other, the last one draws.
+			if (OrderIndependentParticles) {
+				UseParticleProgram(ParticleOITProgram, ParticleOITCameraRightMatrix, ParticleOITCameraUpMatrix, ParticleOITVPMatrix, ParticleTextures.texture, RainViewMatrix, RainViewProjectionMatrix);
+			}
+			else if (gpuSort) {
+				UseParticleProgram(ParticleSortedProgram, ParticleSortedCameraRightMatrix, ParticleSortedCameraUpMatrix, ParticleSortedVPMatrix, ParticleTextures.texture, RainViewMatrix, RainViewProjectionMatrix);
+			}
+			else {
+				UseParticleProgram(ParticleProgram, ParticleCameraRightMatrix, ParticleCameraUpMatrix, ParticleVPMatrix, ParticleTextures.texture, RainViewMatrix, RainViewProjectionMatrix);
+			}
+			if (!OrderIndependentParticles && !lowResParticles) {
+				glEnable(GL_BLEND);
+				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			}
+			if (gpuSort) {
+				DrawSortedParticleInstances(ParticleStream, particlesCount);
+			}
+			else {
+				DrawParticleInstances(ParticleStream, particlesCount);
+			}
+			// Procedural rain over them, scaled with the budget like the emission
+			if (UseProceduralRain) {
+				RainDrops.Draw(OrderIndependentParticles, ParticleFrameBudget.Emission(RainDrops.drops), back, RainEmitter::Direction(windStrength), particleSizeScale,
+					ParticleTextures.texture, RainViewMatrix, RainViewProjectionMatrix);
 			}
 		}
-		SortSplashParticles();
-		// Use our shader
-		glUseProgram(RainProgram);
-		// Bind our texture in Texture Unit 0
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, RainTexture);
-		// Set our "myTextureSampler" sampler to use Texture Unit 0
-		glUniform1i(RainTextureID, 0);
-		// Send our transformation to the currently bound shader, 
-		// in the "MVP" uniform
-		glUniform3f(RainCameraRightMatrix, RainViewMatrix[0][0], RainViewMatrix[1][0], RainViewMatrix[2][0]);
-		glUniform3f(RainCameraUpMatrix, RainViewMatrix[0][1], RainViewMatrix[1][1], RainViewMatrix[2][1]);
-		glUniformMatrix4fv(RainVPMatrix, 1, GL_FALSE, &RainViewProjectionMatrix[0][0]);
-		// Draw object
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glBindBuffer(GL_ARRAY_BUFFER, SplashPositionVBO);
-		glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, splashParticlesCount * sizeof(GLfloat) * 4, splash_position);
-		glBindBuffer(GL_ARRAY_BUFFER, SplashColorVBO);
-		glBufferData(GL_ARRAY_BUFFER, MaxParticles * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, splashParticlesCount * sizeof(GLubyte) * 4, splash_color);
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, SplashVBO);
-		glVertexAttribPointer(
-			0,                  // attribute. No particular reason for 0, but must match the layout in the shader.
-			3,                  // size
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-		);
-		// Position object
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, SplashPositionVBO);
-		glVertexAttribPointer(
-			1,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-			4,                                // size : x + y + z + size => 4
-			GL_FLOAT,                         // type
-			GL_FALSE,                         // normalized?
-			0,                                // stride
-			(void*)0                          // array buffer offset
-		);
-		// Color object
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, SplashColorVBO);
-		glVertexAttribPointer(
-			2,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-			4,                                // size : r + g + b + a => 4
-			GL_UNSIGNED_BYTE,                 // type
-			GL_TRUE,                          // normalized?    *** YES, this means that the unsigned char[4] will be accessible with a vec4 (floats) in the shader ***
-			0,                                // stride
-			(void*)0                          // array buffer offset
-		);
-		glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
-		glVertexAttribDivisor(1, 1); // positions : one per quad (its center)                 -> 1
-		glVertexAttribDivisor(2, 1); // color : one per quad                                  -> 1
-		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, splashParticlesCount);
+		if (OrderIndependentParticles) {
+			ParticleTransparency.Resolve();
+		}
+		else if (lowResParticles) {
+			ParticleLowResolution.Resolve(RainProjectionMatrix);
+		}
+		ParticleFrameBudget.EndDraw();
 
 		glDisableVertexAttribArray(0);
 		glDisableVertexAttribArray(1);
 		glDisableVertexAttribArray(2);
-
-		// Swap buffers
+	
+		// Swap buffers, not counted in the frame time as it waits for vsync
+		ParticleFrameBudget.EndFrame((float)(1000.0 * (glfwGetTime() - frameStartTime)), (float)(1000.0 * particleSimulateTime), (float)(1000.0 * particleSortTime));
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 
@@ -1379,6 +1700,12 @@ int main(void)
 	while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
 		glfwWindowShouldClose(window) == 0);
 
+	// Finish the recording with the checksum a replay must reproduce
+	if (ParticleInputLog.Recording()) {
+		printf("Recorded %u particle steps, checksum %08x\n", ParticleInputLog.steps, ParticleChecksum());
+	}
+	ParticleInputLog.Close(ParticleChecksum());
+
 	// Cleanup VBO
 	glDeleteBuffers(1, &CarEBO);
 	glDeleteBuffers(1, &BackwheelEBO);
@@ -1394,35 +1721,44 @@ int main(void)
 	glDeleteBuffers(1, &jendelaBelakangVBO);
 	glDeleteBuffers(1, &jendelaBelakangGreyVBO);
 	glDeleteBuffers(1, &SunVBO);
-	glDeleteBuffers(1, &SmokeVBO);
-	glDeleteBuffers(1, &SmokePositionVBO);
-	glDeleteBuffers(1, &SmokeColorVBO);
-	glDeleteBuffers(1, &RainVBO);
-	glDeleteBuffers(1, &RainPositionVBO);
-	glDeleteBuffers(1, &RainColorVBO);
-	glDeleteBuffers(1, &SplashVBO);
-	glDeleteBuffers(1, &SplashPositionVBO);
-	glDeleteBuffers(1, &SplashColorVBO);
+	ParticleStream.Delete();
 	glDeleteProgram(CarProgram);
 	glDeleteProgram(BackwheelProgram);
 	glDeleteProgram(FrontwheelProgram);
 	glDeleteProgram(FrontWindowProgram);
 	glDeleteProgram(GreyWindowProgram);
 	glDeleteProgram(SunProgram);
-	glDeleteProgram(SmokeProgram);
-	glDeleteProgram(RainProgram);
+	glDeleteProgram(ParticleProgram);
+	glDeleteProgram(ParticleOITProgram);
+	ParticleTransparency.Delete();
+	ParticleLowResolution.Delete();
+	ParticleFrameBudget.Delete();
+	if (UseGpuParticles) {
+		SmokeGpuParticles.Delete();
+		RainGpuParticles.Delete();
+		SplashGpuParticles.Delete();
+		GpuPrograms.Delete();
+		glDeleteProgram(GpuParticleProgram);
+		glDeleteProgram(GpuOITProgram);
+		glDeleteBuffers(1, &SmokeVBO);
+		glDeleteBuffers(1, &RainVBO);
+		glDeleteBuffers(1, &SplashVBO);
+	}
+	if (UseGpuSort) {
+		ParticleGpuSorter.Delete();
+		glDeleteProgram(ParticleSortedProgram);
+	}
+	if (UseProceduralRain) {
+		RainDrops.Delete();
+	}
 	glDeleteTextures(1, &Texture);
-	glDeleteTextures(1, &SmokeTexture);
-	glDeleteTextures(1, &RainTexture);
+	ParticleTextures.Delete();
 	glDeleteVertexArrays(1, &CarVAO);
 	glDeleteVertexArrays(1, &BackwheelVAO);
 	glDeleteVertexArrays(1, &FrontwheelVAO);
 	glDeleteVertexArrays(1, &jendelaBelakangVAO);
 	glDeleteVertexArrays(1, &jendelaBelakangGreyVAO);
 	glDeleteVertexArrays(1, &SunVAO);
-	glDeleteVertexArrays(1, &SmokeVAO);
-	glDeleteVertexArrays(1, &RainVAO);
-	glDeleteVertexArrays(1, &SplashVAO);
 
 	// Close OpenGL window and terminate GLFW
 	glfwTerminate();